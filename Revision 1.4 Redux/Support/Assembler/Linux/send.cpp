@@ -0,0 +1,294 @@
+// Native HEX file uploader for the 'Minimal 64x4 Home Computer' (replaces send.sh)
+// 17.10.2026
+
+// Build with: g++ send.cpp -std=c++17 -O2 -pthread -osend -s
+// Usage:      ./asm prog.asm | ./send [options]   or   ./send [options] prog.hex
+
+// The Minimal reads its UART through a single register (no FIFO) and decodes a HEX line after its LF.
+// Characters arriving during the decoding are lost. So each line is sent as one block and the next line
+// is scheduled for the moment the previous one has left the wire (chars * 10 bits / bit rate, 7N2) plus
+// the decoding time of the Minimal. All deadlines are absolute: write() returns as soon as the kernel
+// has buffered a line, so the system call overhead overlaps with the transmission of the previous line.
+
+// CHANGE LOG:
+// 17.10.2026: First version with termios setup, byte count pacing, echo readback and a pty simulator.
+// 17.10.2026: Lines are paced by the 10ms/line decoding time of the manual, the simulator decodes as slowly.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+
+using Clock = std::chrono::steady_clock;
+using Micros = std::chrono::duration<double, std::micro>;
+
+struct Options
+{
+  std::string dev = "/dev/ttyUSB0";
+  int baud = 500000;                                 // MINIMAL UART: 500kbps, 7N2 = 10 bits per char
+  int gap = 10000;                                   // µs the Minimal needs to decode a line (manual: 10ms/line)
+  int timeout = 1000;                                // ms to wait for an echo
+  bool echo = false;                                 // wait for each line to come back (needs an echoing loader)
+  bool sim = false;                                  // send to a pty with a simulated Minimal attached
+  int simdecode = 10000;                             // µs decoding time of the simulated Minimal
+};
+
+speed_t baudConst(int baud)                          // maps a bit rate to its termios constant
+{
+  switch (baud)
+  {
+    case 9600: return B9600; case 19200: return B19200; case 38400: return B38400;
+    case 57600: return B57600; case 115200: return B115200; case 230400: return B230400;
+#ifdef B500000
+    case 500000: return B500000;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+    default: return B0;
+  }
+}
+
+int openTTY(const std::string& dev, int baud)        // opens a tty in raw 7N2 mode, returns -1 on failure
+{
+  speed_t speed = baudConst(baud);
+  if (speed == B0) { std::cerr << "ERROR: Unsupported bit rate " << baud << ".\n"; return -1; }
+  int fd = open(dev.c_str(), O_RDWR | O_NOCTTY);
+  if (fd < 0) { std::cerr << "ERROR: Can't open " << dev << ": " << strerror(errno) << ".\n"; return -1; }
+  termios t;
+  if (tcgetattr(fd, &t) != 0) { std::cerr << "ERROR: " << dev << " is not a tty.\n"; close(fd); return -1; }
+  cfmakeraw(&t);
+  t.c_cflag = (t.c_cflag & ~(CSIZE | PARENB | CRTSCTS)) | CS7 | CSTOPB | CLOCAL | CREAD;
+  t.c_cc[VMIN] = 0; t.c_cc[VTIME] = 0;
+  cfsetispeed(&t, speed); cfsetospeed(&t, speed);
+  if (tcsetattr(fd, TCSANOW, &t) != 0) { std::cerr << "ERROR: Can't configure " << dev << ".\n"; close(fd); return -1; }
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+void waitUntil(Clock::time_point t)                 // sleeps, then spins the last 200µs (sleep overshoots)
+{
+  std::this_thread::sleep_until(t - std::chrono::microseconds(200));
+  while (Clock::now() < t) {}
+}
+
+bool writeAll(int fd, const char* p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) { if (errno == EINTR) continue; return false; }
+    p += w; n -= w;
+  }
+  return true;
+}
+
+bool readLine(int fd, std::string& line, int timeout) // reads up to and including LF, false on timeout
+{
+  line.clear();
+  Clock::time_point end = Clock::now() + std::chrono::milliseconds(timeout);
+  char c;
+  while (true)
+  {
+    int ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - Clock::now()).count();
+    pollfd p { fd, POLLIN, 0 };
+    if (ms <= 0 || poll(&p, 1, ms) <= 0) return false;
+    if (read(fd, &c, 1) == 1) { if (c == '\r') continue; line += c; if (c == '\n') return true; }
+  }
+}
+
+int hexByte(const std::string& s, int p)             // parses two HEX digits, -1 if invalid
+{
+  int v = 0;
+  for (int i=p; i<p+2; i++)
+  {
+    if (i >= int(s.size())) return -1;
+    char c = s[i];
+    if (c >= '0' && c <= '9') v = v*16 + c - '0';
+    else if (c >= 'A' && c <= 'F') v = v*16 + c - 'A' + 10;
+    else return -1;
+  }
+  return v;
+}
+
+// ------------------------------------------------------------------------
+// Model of MinOS 'receive' on the other side of a pty: characters complete
+// on a virtual wire at the given bit rate and are lost while a line is
+// being decoded. Lines are checked like the Minimal does it. The wire is
+// timed by the write log of the sender, not by the (jittery) read time.
+// ------------------------------------------------------------------------
+class Minimal
+{
+  public:
+    Minimal(int fd, const Options& opt) : mFd(fd), mChar(10e6 / opt.baud), mDecode(opt.simdecode), mEcho(opt.echo) {}
+    void Sent(long offset, Clock::time_point t)     // called by the sender before it writes at offset
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mWrites.emplace_back(offset, t);
+    }
+    void Run()                                       // returns after the EOF record or 1s of silence
+    {
+      char buf[4096];
+      Clock::time_point wire{}, busy{};
+      long offset = 0;                               // index of the next received char
+      size_t w = 0;                                  // write log entry of the next char
+      while (!iseof)
+      {
+        pollfd p { mFd, POLLIN, 0 };
+        if (poll(&p, 1, 1000) <= 0) break;
+        ssize_t n = read(mFd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (int i=0; i<n; i++, offset++)
+        {
+          Clock::time_point t;
+          {
+            std::lock_guard<std::mutex> lock(mMutex);
+            while (w+1 < mWrites.size() && mWrites[w+1].first <= offset) w++;
+            t = mWrites[w].second;
+          }
+          wire = std::max(wire, t) + std::chrono::duration_cast<Clock::duration>(Micros(mChar));
+          if (wire < busy) { lost++; continue; }     // register overwritten while decoding
+          if (buf[i] == '\r') continue;
+          line += buf[i];
+          if (buf[i] == '\n')
+          {
+            decode(); lines++;
+            busy = wire + std::chrono::duration_cast<Clock::duration>(Micros(mDecode));
+            if (mEcho) { std::this_thread::sleep_until(busy); writeAll(mFd, line.data(), line.size()); }
+            line.clear();
+          }
+        }
+      }
+    }
+    int lines = 0, bytes = 0, lost = 0, errors = 0;
+    bool iseof = false;
+  protected:
+    void decode()                                    // verifies a ":LLAAAATT..CC" record
+    {
+      int len = hexByte(line, 1);
+      if (line[0] != ':' || len < 0) { errors++; return; }
+      int sum = 0;
+      for (int i=0; i<len+5; i++)
+      {
+        int b = hexByte(line, 1 + 2*i);
+        if (b < 0) { errors++; return; }
+        sum += b;
+      }
+      if ((sum & 0xff) != 0) { errors++; return; }
+      if (hexByte(line, 7) == 0x01) iseof = true; else bytes += len;
+    }
+    int mFd;
+    double mChar, mDecode;                           // µs per char on the wire, µs per decoded line
+    bool mEcho;
+    std::string line;
+    std::mutex mMutex;
+    std::vector<std::pair<long, Clock::time_point>> mWrites;
+};
+
+int main(int argc, char *argv[])
+{
+  Options opt;
+  const char* filename = nullptr;
+  for (int i=1; i<argc; i++)
+  {
+    if (strncmp(argv[i], "--dev=", 6) == 0) opt.dev = &argv[i][6];
+    else if (strncmp(argv[i], "--baud=", 7) == 0) opt.baud = atoi(&argv[i][7]);
+    else if (strncmp(argv[i], "--gap=", 6) == 0) opt.gap = std::max(0, atoi(&argv[i][6]));
+    else if (strncmp(argv[i], "--timeout=", 10) == 0) opt.timeout = std::max(1, atoi(&argv[i][10]));
+    else if (strcmp(argv[i], "--echo") == 0) opt.echo = true;
+    else if (strcmp(argv[i], "--sim") == 0) opt.sim = true;
+    else if (strncmp(argv[i], "--sim-decode=", 13) == 0) { opt.sim = true; opt.simdecode = std::max(0, atoi(&argv[i][13])); }
+    else if (argv[i][0] == '-' && argv[i][1] != 0)
+    {
+      std::cout << "Native HEX file uploader for the Minimal 64x4 Home Computer\n";
+      std::cout << "Usage: send [options] [<hexfile>] (reads stdin without a file)\n";
+      std::cout << "  --dev=<tty>        serial device (default: /dev/ttyUSB0)\n";
+      std::cout << "  --baud=<n>         bit rate (default: 500000), 7N2\n";
+      std::cout << "  --gap=<us>         decoding time per line (default: 10000)\n";
+      std::cout << "  --echo             waits for each line to be echoed and verifies it\n";
+      std::cout << "                     (needs a loader that echoes, MinOS 'receive' doesn't)\n";
+      std::cout << "  --timeout=<ms>     time to wait for an echo (default: 1000)\n";
+      std::cout << "  --sim              sends to a pty with a simulated Minimal attached\n";
+      std::cout << "  --sim-decode=<us>  decoding time of the simulated Minimal (default: 10000)\n";
+      return 1;
+    }
+    else filename = argv[i];
+  }
+
+  std::string text;                                  // read the HEX file
+  if (filename)
+  {
+    std::ifstream f(filename, std::ios::binary);
+    if (!f) { std::cerr << "ERROR: Can't read " << filename << ".\n"; return 1; }
+    text.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+  }
+  else text.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+  std::vector<std::string> lines;                    // split into LF-terminated lines without CR
+  for (size_t p = 0; p < text.size();)
+  {
+    size_t e = text.find('\n', p); if (e == std::string::npos) e = text.size();
+    std::string l = text.substr(p, e - p);
+    if (!l.empty() && l.back() == '\r') l.pop_back();
+    if (!l.empty()) lines.push_back(l + '\n');
+    p = e + 1;
+  }
+
+  int simfd = -1;                                    // master side of the pty in simulation mode
+  if (opt.sim)
+  {
+    simfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (simfd < 0 || grantpt(simfd) != 0 || unlockpt(simfd) != 0) { std::cerr << "ERROR: Can't create a pty.\n"; return 1; }
+    opt.dev = ptsname(simfd);
+  }
+  int fd = openTTY(opt.dev, opt.baud);
+  if (fd < 0) return 1;
+  Minimal minimal(simfd, opt);
+  std::thread simulator;
+  if (opt.sim) simulator = std::thread([&minimal] { minimal.Run(); });
+
+  const double charus = 10e6 / opt.baud;             // µs per char on the wire
+  int bytes = 0, databytes = 0, mismatches = 0, timeouts = 0;
+  std::string echo;
+  Clock::time_point start = Clock::now(), next = start;
+  for (const std::string& l : lines)
+  {
+    waitUntil(next);
+    Clock::time_point sent = std::max(next, Clock::now());
+    if (opt.sim) minimal.Sent(bytes, sent);
+    if (!writeAll(fd, l.data(), l.size())) { std::cerr << "ERROR: Write to " << opt.dev << " failed.\n"; return 1; }
+    bytes += l.size();
+    if (hexByte(l, 1) > 0) databytes += hexByte(l, 1);
+    next = sent + std::chrono::duration_cast<Clock::duration>(Micros(l.size() * charus + (opt.echo ? 0 : opt.gap)));
+    if (opt.echo)                                    // flow control and verification by the echo
+    {
+      if (!readLine(fd, echo, opt.timeout)) timeouts++;
+      else if (echo != l) mismatches++;
+      next = std::max(next, Clock::now());
+    }
+  }
+  waitUntil(next);
+  tcdrain(fd);
+  double secs = std::chrono::duration<double>(Clock::now() - start).count();
+
+  fprintf(stderr, "%d lines, %d chars (%d data bytes) in %.3fs: %.0f chars/s, %.0f data bytes/s, %.0f%% of the line rate.\n",
+    int(lines.size()), bytes, databytes, secs, bytes / secs, databytes / secs, 100.0 * bytes * charus / 1e6 / secs);
+  if (opt.echo) fprintf(stderr, "Echo: %d mismatches, %d timeouts.\n", mismatches, timeouts);
+  if (opt.sim)
+  {
+    simulator.join();
+    fprintf(stderr, "Simulated Minimal: %d lines, %d data bytes, %d chars lost, %d bad lines%s.\n",
+      minimal.lines, minimal.bytes, minimal.lost, minimal.errors, minimal.iseof ? "" : ", no EOF record");
+    close(simfd);
+  }
+  close(fd);
+  return (mismatches || timeouts || (opt.sim && (minimal.lost || minimal.errors))) ? 1 : 0;
+}
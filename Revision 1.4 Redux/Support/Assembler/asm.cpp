@@ -1,500 +1,336 @@
-// Frontend of the next 'Minimal 64x4 Redux Smart Assembler'
-// by Carsten Herting (slu4) 2025, last update 13.7.2025
+// Frontend of the next 'Minimal 64x4 Redux Smart Assembler', the assembler itself is the library minasm.cpp
+// by Carsten Herting (slu4) 2025, last update 17.10.2026
 
-// Build with: g++ asm.cpp -O2 -oasm.exe -s
+// Build with: g++ asm.cpp minasm.cpp -std=c++17 -O2 -pthread -oasm.exe -s
 
 // CHANGE LOG:
 // 09.02.2025: Bugfix in handling of fast jump arguments in pass 2.
 // 09.02.2025: Setting the default start address of the HEX printer to 0x2000 (same as asm.asm).
 // 10.02.2025: Nicer HexPrinter
+// 17.10.2026: Labels are held in a hashed symbol table (O(1) definition and lookup).
+// 17.10.2026: Mnemonics are decoded via a compile-time perfect hash instead of 256 strcmp's.
+// 17.10.2026: The source is tokenized once, both passes and the symbol output iterate over the tokens.
+// 17.10.2026: Source files are memory-mapped and handled as string_view, no more per-element copies.
+// 17.10.2026: findelem() scans whitespace, comments and elements with SSE2/AVX2 where available.
+// 17.10.2026: Line numbers via a line index, option --all-errors to report all errors, --diag=gnu|json.
+// 17.10.2026: Table-driven HEX output, new output formats: S-records, binary image, segment list.
+// 17.10.2026: 64KB image model (overlap warnings), record length, gap merging and upload time report.
+// 17.10.2026: Option --pack outputs an LZ-compressed image together with an unpacker for faster uploads.
+// 17.10.2026: Option --batch assembles many files concurrently on a work-stealing thread pool.
+// 17.10.2026: Pass 2 of large sources runs in parallel on parts split at '#org', stitched in source order.
+// 17.10.2026: Persistent build cache keyed by the hash of source, assembler version, ISA tables and options.
+// 17.10.2026: '#include "file"' and '#once', included files are tokenized once per process, errors show their file.
+// 17.10.2026: Option --export writes a binary symbol file, '#import "file" ["tag"]' defines its symbols without lexing.
+// 17.10.2026: The assembler is a library (minasm.h) with reusable contexts, asm.cpp is its command line frontend.
+// 17.10.2026: Option --watch reassembles on every save, lexing only the edited lines, and answers editor queries.
+// 17.10.2026: bench.cpp times every phase on the shipped programs and generated sources, JSON reports can be compared.
+// 17.10.2026: Option --stats[=json] reports the time of each phase and what the source contains.
+// 17.10.2026: Option --relax turns jumps into fast page-local jumps wherever their target lies in the same page.
+// 17.10.2026: Option --optimize rewrites instruction windows into equivalent ones of fewer cycles (see CYCLES).
+// 17.10.2026: '#var name: [size]' declares variables, the most used ones get the free zero page ('#zp', '#data').
+// 17.10.2026: '#macro'/'#endm' and '#rep n [counter]'/'#endr' expand in the token stream, --list shows the expansions.
+// 17.10.2026: Expressions with C operators, parentheses and math built-ins, '#bytes'/'#words' generate tables.
+// 17.10.2026: Option --strip leaves out the blocks nothing reaches from '#org' and '#entry label', reports block sizes.
 
+#include "minasm.h"
 #include <vector>
 #include <string>
-#include <cstdint>
-#include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <cstring>
-#include <sstream>
 #include <algorithm>
+#include <thread>
+#include <filesystem>
+#include <chrono>
+#include <map>
+#include <set>
+#ifdef _WIN32
+  #include <io.h>
+  #include <fcntl.h>
+#else
+  #include <glob.h>
+#endif
+#ifdef __linux__
+  #include <sys/inotify.h>
+  #include <poll.h>
+  #include <unistd.h>
+#endif
 
-// Minimal 64x4 Redux 1.4 mnemonic tokens Feb 14th 2025
-const std::vector<std::string> MNEMONICS // Index = OpCode
+void addSources(std::vector<std::string>& names, const std::string& arg) // a file, a glob pattern or an @manifest of them
 {
-  "NOP","OUT","INT","INK","WIN","LL0","LL1","LL2","LL3","LL4","LL5","LL6","LL7","RL0","RL1","RL2",
-  "RL3","RL4","RL5","RL6","RL7","RR1","LR0","LR1","LR2","LR3","LR4","LR5","LR6","LR7","LLZ","LLB",
-  "LLV","LLW","LLQ","LLL","LRZ","LRB","RLZ","RLB","RLV","RLW","RLQ","RLL","RRZ","RRB","NOT","NOZ",
-  "NOB","NOV","NOW","NOQ","NEG","NEZ","NEB","NEV","NEW","NEQ","ANI","ANZ","ANB","ANT","ANR","ZAN",
-  "BAN","TAN","RAN","ORI","ORZ","ORB","ORT","ORR","ZOR","BOR","TOR","ROR","XRI","XRZ","XRB","XRT",
-  "XRR","ZXR","BXR","TXR","RXR","FNE","FEQ","FCC","FCS","FPL","FMI","FGT","FLE","FPA","BNE","BEQ",
-  "BCC","BCS","BPL","BMI","BGT","BLE","JPA","JPR","JAR","JPS","JAS","RTS","PHS","PLS","LDS","SDS",
-  "RDB","RDR","RAP","RZP","WDB","WDR","LDI","LDZ","LDB","LDT","LDR","LAP","LAB","LZP","LZB","SDZ",
-  "SDB","SDT","SDR","SZP","MIZ","MIB","MIT","MIR","MIV","MIW","MZZ","MZB","MZT","MZR","MBZ","MBB",
-  "MBT","MBR","MTZ","MTB","MTT","MTR","MRZ","MRB","MRT","MRR","MVV","MWV","CLD","CLZ","CLB","CLV",
-  "CLW","CLQ","CLL","CL5","INC","INZ","INB","INV","INW","INQ","DEC","DEZ","DEB","DEV","DEW","DEQ",
-  "ADI","ADZ","ADB","ADT","ADR","ZAD","BAD","TAD","RAD","ADV","ADW","ADQ","AIZ","AIB","AIT","AIR",
-  "AIV","AIW","AIQ","AZZ","AZT","AZV","AZQ","ABB","ABW","ATZ","ATT","AVV","SUI","SUZ","SUB","SUT",
-  "SUR","ZSU","BSU","TSU","RSU","SUV","SUW","SUQ","SIZ","SIB","SIT","SIR","SIV","SIW","SIQ","SZZ",
-  "SZT","SZV","SZQ","SBB","SBW","STZ","STT","SVV","CPI","CPZ","CPB","CPT","CPR","CIZ","CIB","CIT",
-  "CIR","CIV","CIW","CZZ","CZT","CBB","CTZ","CTT","CVV","ACI","ACZ","ZAC","SCI","SCZ","ZSC","???",
-};
-
-// argument info: bits0-3: argtype1, bits 4-7: argtype2
-// types: 0=none, 1=expect byte, 2=zero page, 3=expect word, 4=fast jump
-const std::vector<int> ARGS // Index = OpCode
-{
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03,
-  0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x00, 0x02,
-  0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02, 0x01, 0x02, 0x03, 0x02, 0x03, 0x02,
-  0x03, 0x02, 0x03, 0x01, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x01, 0x02, 0x03, 0x02,
-  0x03, 0x02, 0x03, 0x02, 0x03, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x03, 0x03,
-  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x01, 0x01,
-  0x13, 0x03, 0x03, 0x32, 0x13, 0x03, 0x01, 0x02, 0x03, 0x02, 0x03, 0x01, 0x03, 0x12, 0x32, 0x02,
-  0x03, 0x02, 0x03, 0x12, 0x21, 0x31, 0x21, 0x31, 0x23, 0x33, 0x22, 0x32, 0x22, 0x32, 0x23, 0x33,
-  0x23, 0x33, 0x22, 0x32, 0x22, 0x32, 0x23, 0x33, 0x23, 0x33, 0x22, 0x23, 0x00, 0x02, 0x03, 0x02,
-  0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02,
-  0x01, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x21, 0x31, 0x21, 0x31,
-  0x21, 0x31, 0x21, 0x22, 0x22, 0x22, 0x22, 0x33, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x03, 0x02,
-  0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x21, 0x31, 0x21, 0x31, 0x21, 0x31, 0x21, 0x22,
-  0x22, 0x22, 0x22, 0x33, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x03, 0x02, 0x03, 0x21, 0x31, 0x21,
-  0x31, 0x23, 0x33, 0x22, 0x22, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x02, 0x01, 0x02, 0x02, 0x00,
-};
-
-class HexPrinter // handling output in 'Intel HEX' format
-{
-  public:
-    HexPrinter(std::stringstream& out) : mOut(out) {}
-    ~HexPrinter() { if (!buffer.empty()) flush(); if (wasUsed) mOut << ":00000001FF\n"; } // write end of hex file
-    void SetAddress(int laddr) { if (!buffer.empty()) flush(); addr = laddr; } // begin new line at new address
-    int GetAddress() { return addr + buffer.size(); } // returns the current emission address
-    void Emit(uint8_t b) { wasUsed = true; buffer.push_back(b); if (buffer.size() == 16) flush(); } // emit a byte
-  protected:
-    void flush() // emits current buffer as a line (only call if buffer is non-empty!)
-    {
-      mOut << ":" << std::hex << std::uppercase << std::setfill('0');
-      int n = buffer.size();
-      int pch = (addr & 0xff00)>>8;
-      int pcl = addr & 0x00ff;
-      mOut << std::setw(2) << n << std::setw(2) << pch << std::setw(2) << pcl << "00";
-      int sum = buffer.size() + pch + pcl;
-      for (uint8_t b : buffer) { mOut << std::setw(2) << int(b); sum += b; }
-      mOut << std::setw(2) << (-sum & 0xff) << "\n";
-      addr += buffer.size(); buffer.clear();
-    }
-    bool wasUsed = false; // detect whether at least one byte was emitted
-    std::vector<uint8_t> buffer; // emission line buffer
-    int addr{ 0x2000 }; // start address of the current data in buffer
-    std::stringstream& mOut; // emission into this string stream
-};
-
-int opCode(const std::string& s, int p, int len) // returns the op code at the specified position and length
-{
-  if (len < 3 || len > 4) return -1; // can't be an op code
-
-  char mne[4]; mne[3] = 0;
-  if (len == 4) // mnemonic has a dot AB.C -> CAB
-  {
-    if (s[p+2] == '.') { mne[0] = s[p+3]; mne[1] = s[p+0]; mne[2] = s[p+1]; } else return -1;
-  }
-  else { mne[0] = s[p+0]; mne[1] = s[p+1]; mne[2] = s[p+2]; }
-  
-  for (int i=0; i<3; i++) if (mne[i] & 0b01000000) mne[i] = mne[i] & 0b11011111;
-
-  for (int i=0; i<MNEMONICS.size(); i++) if (strcmp(mne, MNEMONICS[i].c_str()) == 0) return i;
-
-  return -1;
-}
-
-int ln(const std::string& s, int p) // calculates the line number of the element pos in the source
-{
-  int num = 1;
-  for (int i=0; i<=p; i++) if (s[i] == '\n') num++;
-  return num;
-}
-
-int findelem(const std::string& s, int& ep) // moves ep to an element and returns its length, 0: valid EOF, -1: error
-{
-  while (true)
+  if (arg.size() > 1 && arg[0] == '@')
   {
-    if (s[ep] == 0) return 0; // handle EOF
-    else if (s[ep] <= 32 || s[ep] == ',') ep++; // handle whitespaces
-    else // it must be a real character
+    std::ifstream list(arg.substr(1));
+    if (!list.is_open()) { names.push_back(arg.substr(1)); return; } // reported as unopenable source
+    for (std::string line; std::getline(list, line);)
     {
-      if (s[ep] == ';') // handle ; comments
-      {
-        while (true)
-        {
-          ep++;
-          if (s[ep] == 0) return 0; // EOF at the end of a comment reached
-          if (s[ep] == '\n') { ep++; break; } // consume LF and close comment
-        }
-      }
-      else // element start, now calc its length
-      {
-        int n = ep; // from now on, parse with a separate pointer
-        while(true)
-        {
-          if (s[n] == '\"' || s[n] == '\'')
-          {
-            char quote = s[n++]; // remember quotation style
-            while (s[n] != quote) if (s[n++] < 32) return -1; // EOF \n \r \t = error
-            n++; // consume end quotation
-          }
-          else // standard element or whitespace end?
-          {
-            if (s[n] <= 32 || s[n] == ',' || s[n] == ';') return n - ep; // element end reached
-            n++; // consume element char
-          }
-        }
-      }
+      line.erase(0, line.find_first_not_of(" \t"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (!line.empty() && line[0] != ';' && line[0] != '#') addSources(names, line);
     }
+    return;
   }
-}
-
-// PASS 1 (isparse = false): only sets descriptive flags, PASS 2: (isparse = true): also computes expression value
-// Input:  Set "isparse", element pointer "ep", element length "elen".
-//         Prior to calling, check the element for being a label-def, long string, pre-proc command.
-// Output: a. Returns TRUE for success and FALSE if an error occured.
-//         b. Sets descriptive flags "isop", "isword", "islsb", "ismsb"
-//         c. Sets expression value "lsb" and "msb" (only if isparse == true)
-// needs access to HexPrinter to retrieve '*' address
-bool parseExpr(const std::string& src, const int ep, const int elen, std::stringstream& errors,
-               const std::vector<std::string>& labels, const std::vector<int>& labelpc,
-               bool& isop, bool& isword, bool& islsb, bool& ismsb, const bool isparse,
-               int& lsb, int& msb, HexPrinter& hex)
-{
-  isop = isword = islsb = ismsb = false; // all flags off
-
-  if ((lsb = opCode(src, ep, elen)) != -1) { isop = true; return true; }
-
-  int expr = 0, x = ep; // init result
-
-  if (src[x] == '<' || src[x] == '>') // exptract a leading MSB/LSB operator
+#ifndef _WIN32
+  if (arg.find_first_of("*?[") != std::string::npos)
   {
-    if (src[x++] == '<') islsb = true; else ismsb = true;
+    glob_t g;
+    if (glob(arg.c_str(), 0, nullptr, &g) == 0) for (size_t i=0; i<g.gl_pathc; i++) names.push_back(g.gl_pathv[i]);
+    globfree(&g);
+    return;
   }
-
-  do
-  {
-    int term = 0, sign = 1;
-
-    if (src[x] == '+') { sign = 1; x++; } // take leading sign, reset term
-    else if (src[x] == '-') { sign = -1; x++; }
-
-    if (src[x] == '\'') // single characters '.'
-    {
-      if (elen >= 3 && src[x+2] == '\'') { term = src[x+1]; x += 3; }
-      else { errors << "ERROR in line " << ln(src, ep) << ": Invalid expression.\n"; return false; }
-    }
-    else if (src[x] == '\"') // single characters "."
-    {
-      if (elen >= 3 && src[x+2] == '\"') { term = src[x+1]; x += 3; }
-      else { errors << "ERROR in line " << ln(src, ep) << ": Invalid expression.\n"; return false; }
-    }
-    else if (src[x] == '0' && src[x+1] == 'x') // hex number
-    {
-      size_t k = src.find_first_not_of("0123456789abcdefABCDEF", x+2);
-      if (k == std::string::npos) k = ep + elen;
-      if (k == x+2) { errors << "ERROR in line " << ln(src, ep) << ": Invalid HEX value.\n"; return false; }
-      else
-      {
-        if (isparse) term = std::stoi(src.substr(x+2, k-(x+2)), nullptr, 16);
-        if (k > x+4) isword = true;
-      }
-      x = k;
-    }
-    else if (src[x] == '*') { term = hex.GetAddress(); isword = true; x++; } // * = emission pointer
-    else if (src[x] >= '0' && src[x] <= '9') // decimal number
-    {
-      while (src[x] >= '0' && src[x] <= '9') { term *= 10; term += src[x++] - '0'; }
-      if (sign*term > 255 || sign*term < -128) isword = true; // use chose word deliberately
-    }
-    else // must be a label ref or embedded mnemonic
-    {
-      size_t k = src.find_first_of(" +-\n\r\t,;\0", x); // find end of label ref (k is well-defined <= ep + elen)
-      if (k == x) { errors << "ERROR in line " << ln(src, ep) << ": Empty expression.\n"; return false; }
-      if ((term = opCode(src, x, k-x)) == -1) // op code as part of an expression? ... or label ref?
-      {
-        isword = true;
-        if (isparse) // only possible during pass 2
-        {
-          std::string ref = src.substr(x, k-x); // cut out this reference
-          bool isknown = false; // is it a known label?
-          for(int i=0; i<labels.size(); i++) // find value of label
-            if (ref == labels[i]) { term = labelpc[i]; isknown = true; break; }
-          if (!isknown) { errors << "ERROR in line " << ln(src, ep) << ": Unknown reference \'" << ref << "\'.\n"; return false; }
-        }
-      }
-      x = k; // consume this element part
-    }
-    expr += sign * term; // add this term to the expression
-  } while (src[x] == '+' || src[x] == '-');
-
-  if (x != ep + elen) { errors << "ERROR in line " << ln(src, ep) << ": Invalid expression.\n"; return false; }
-
-  lsb = expr & 0xff; msb = (expr >> 8) & 0xff; // store resulting LSB/MSB
-  return true; // success
+#endif
+  names.push_back(arg);
 }
 
-void Assembler(const std::string& src, std::stringstream& hexout, std::stringstream& errors, bool dosym, std::string symtag)
+#ifdef __linux__
+// Keeps assembling the source whenever it or one of its included files is saved and writes the output file. The tokens
+// and symbols stay in memory, only the edited lines are lexed again. An editor talks to it line by line via stdin/stdout:
+//   sym <label>  ->  'sym <label> 0x1234' or 'sym <label> unknown'
+//   errors       ->  'error <file>:<line>:<col>: <message>' lines, then 'end'
+//   output       ->  the output (text formats), then 'end'
+//   assemble     ->  assembles now, quit (or closing stdin) ends watching
+// Each assembly reports 'ok <output file> <bytes> <ms>' or its errors and 'failed <errors> <ms>', then its notes.
+int Watch(const std::string& filename, const Options& opt, const std::string& outdir, std::string exportfile)
 {
-  std::vector<std::string> labels; // Liste aller Label-Definitionen mit ":"
-  std::vector<int> labelpc; // Adresse aller Label-Definitionen
-  HexPrinter hex(hexout); // contains an "emission counter", use HEX.GetAddress()
-  bool isemit = true; // default true
-  bool isop, isword, islsb, ismsb; // expression result flags
-  int lsb, msb; // expression result
-  int args = 0; // "expect" arguments nibble pipeline
-  int elen = 0; // length of current element at ep
-  int pc = 0; // program counter keeping track of target location
-  int ep = 0; // elememt string index
-
-// ******************
-// ***** PASS 1 *****
-// ******************
-  while ((elen = findelem(src, ep)) > 0) // any element to process?
+  static const char* EXT[] = { ".hex", ".s19", ".bin", ".seg" };
+  std::filesystem::path target = std::filesystem::path(filename).replace_extension(opt.dosym ? ".sym" : EXT[opt.format]);
+  if (!outdir.empty()) target = std::filesystem::path(outdir) / target.filename();
+  if (opt.doexport && exportfile.empty()) exportfile = std::filesystem::path(filename).replace_extension(".msym").string();
+  int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify < 0) { std::cout << "ERROR: Can't watch files.\n"; return 1; }
+  AsmContext ctx;
+  std::string src, input; // the source, unprocessed input of the editor
+  std::set<std::string> files; // canonical paths of the source and its included files
+  std::map<int, std::string> dirs; // watched directories
+  auto canonical = [](const std::filesystem::path& path)
+    { std::error_code ec; std::filesystem::path c = std::filesystem::weakly_canonical(path, ec); return ec ? path : c; };
+  auto errors = [&]
   {
-    // always parse for...
-    if (src[ep+elen-1] == ':') // label definition
-    {
-      std::string def = src.substr(ep, elen-1);
-      bool isknown = false; // is it a known label?
-      for(int i=0; i<labels.size(); i++) // search existing label database
-        if (def == labels[i]) { errors << "ERROR in line " << ln(src, ep) << ": Definition already exists.\n"; return; }
-      labels.emplace_back(src.substr(ep, elen-1)); labelpc.emplace_back(pc); // accept as new definition
-    }
-    else if (src[ep] == '#') // preprocessor command (ignore any #... but #org in pass 1)
+    ctx.VisitErrors([&](const AsmMessage& m)
+      { std::cout << "error " << (m.file.empty() ? filename : m.file) << ":" << m.line << ":" << m.column << ": " << m.text << "\n"; });
+  };
+  auto assemble = [&]
+  {
+    auto start = std::chrono::steady_clock::now();
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) { std::cout << "failed can't open \"" << filename << "\"\n" << std::flush; return; }
+    src.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    bool isok = ctx.Update(src, opt, filename);
+    if (isok)
     {
-      if (elen == 4 && src.substr(ep+1,3) == "org")
-      {
-        bool isOrg = false; ep += elen; elen = findelem(src, ep); // consume '#org' element and look for next element '0x....'
-        if (elen > 2 && elen <=6 && src[ep] == '0' && src[ep+1] == 'x') // any hex word 0x.
-        {
-          size_t k = src.find_first_not_of("0123456789abcdefABCDEF", ep+2);
-          if (k == std::string::npos) k = ep + elen;
-          if (k == ep + elen) { pc = std::stoi(src.substr(ep+2, k - (ep+2)), nullptr, 16); isOrg = true; }
-        }
-        if (!isOrg) { errors << "ERROR in line " << ln(src, ep) << ": Expecting a 16-bit HEX address.\n"; return; }
-      }
-      else if (elen == 5 & src.substr(ep+1, 4) == "page")
-      {
-        int delta = (-(pc & 0xff)) & 0xff;
-        pc += delta;
-      }
+      std::ofstream out(target, std::ios::binary);
+      isok = bool(out.write(ctx.Output().data(), ctx.Output().size()));
+      if (isok && opt.doexport) isok = bool(std::ofstream(exportfile, std::ios::binary).write(ctx.Symbols().data(), ctx.Symbols().size()));
+      if (!isok) std::cout << "failed can't write \"" << target.string() << "\"\n";
     }
-    else // PARSE MODE-SPECIFICALLY
+    else errors();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (isok) std::cout << "ok " << target.string() << " " << ctx.Output().size() << " " << ms << "\n";
+    else if (ctx.ErrorCount() > 0) std::cout << "failed " << ctx.ErrorCount() << " " << ms << "\n";
+    ctx.PrintNotes(std::cout, "note ");
+    std::cout << std::flush;
+    files.clear(); files.insert(canonical(filename).string()); // watch the directories, editors often replace files
+    files.insert(ctx.Includes().begin(), ctx.Includes().end());
+    for (const std::string& path : files)
     {
-      switch (args & 0x0f) // handle different expectation modes
+      std::string dir = std::filesystem::path(path).parent_path().string();
+      if (std::none_of(dirs.begin(), dirs.end(), [&](const auto& d) { return d.second == dir; }))
       {
-        case 0: // no expectations
-        {
-          if (src[ep] == '\'' && src[ep+elen-1] == '\'') pc += elen-2; // pure 'string'
-          else if (src[ep] == '\"' && src[ep+elen-1] == '\"') pc += elen-2; // pure "string"
-          else
-          {
-            if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, false, lsb, msb, hex)) return;
-            if (isop) { args = ARGS[lsb]; pc++; } // instruction-specific arguments
-            else if (isword && !islsb && !ismsb) pc+=2;
-            else pc++;
-          }
-          break;
-        }
-        case 1: // expect a byte argument
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, false, lsb, msb, hex)) return;
-          if (!isop && (!isword || islsb || ismsb)) pc++;
-          else { errors << "ERROR in line " << ln(src, ep) << ": Expecting a byte argument.\n"; return; }
-          args >>= 4;
-          break;
-        }
-        case 2: // expect zero-page argument
-        {
-          // exits the assembler if an error was written to the error stringstream
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, false, lsb, msb, hex)) return;
-          if (!isop && !ismsb) pc++;
-          else { errors << "ERROR in line " << ln(src, ep) << ": Expecting a zero-page argument.\n"; return; }
-          args >>= 4;
-          break;
-        }
-        case 3: // expect a word argument (may be LSB followed by MSB, too)
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, false, lsb, msb, hex)) return;
-          if (isop) { errors << "ERROR in line " << ln(src, ep) << ": Expecting a word argument.\n"; return; }
-          else if (isword && !islsb && !ismsb) { pc+=2; args >>= 4; }
-          else { pc++; args = (args & 0xf0) | 0x01; } // change expectation to byte (trailing MSB)
-          break;
-        }
-        case 4: // expect a fast jump argument
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, false, lsb, msb, hex)) return;
-          if (!isop && !ismsb) pc++; else { errors << "ERROR in line " << ln(src, ep) << ": Invalid fast jump.\n"; return; }
-          args >>= 4;
-          break;
-        }
+        int wd = inotify_add_watch(notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+        if (wd >= 0) dirs[wd] = dir;
       }
     }
-    ep += elen; // consume processed element
-  }
-  if (elen == -1) { errors << "ERROR in line " << ln(src, ep) << ": Invalid element.\n"; return; }
-
-  // ***********************************************************
-  // ***** output symbolic constants [starting with 'tag'] *****
-  // ***********************************************************
-  if (dosym)
+  };
+  auto command = [&](std::string_view line) // false: quit
   {
-    for(int k=0; k<labels.size(); k++) // Prüfe: Ist das Element ein label?
+    std::string_view cmd = line.substr(0, line.find(' ')), arg;
+    if (cmd.size() < line.size()) arg = line.substr(cmd.size() + 1);
+    if (cmd == "sym")
     {
-      int adr = labelpc[k];
-      if (symtag == labels[k].substr(0, symtag.length()))
-      {
-        hexout << "#org 0x" << std::hex << std::setfill('0') << std::setw(2) << int((adr & 0xff00) >> 8) << std::setw(2) << int(adr&0x00ff) << " " << labels[k] << ":\n";
-      }
+      int value = ctx.Find(arg);
+      char hex[8]; snprintf(hex, sizeof(hex), "0x%04x", value);
+      std::cout << "sym " << arg << " " << (value < 0 ? "unknown" : hex) << "\n";
     }
-    return;
-  }
-
-  // ******************
-  // ***** PASS 2 *****
-  // ******************
-  args = ep = pc = 0; // reset state, back to start of source, use pc for fast-jump check
+    else if (cmd == "errors") { errors(); std::cout << "end\n"; }
+    else if (cmd == "output") { if (opt.format != OUT_BIN) std::cout << ctx.Output(); std::cout << "end\n"; }
+    else if (cmd == "assemble") assemble();
+    else if (cmd == "quit") return false;
+    else if (!cmd.empty()) std::cout << "unknown " << cmd << "\n";
+    std::cout << std::flush;
+    return true;
+  };
 
-  while ((elen = findelem(src, ep)) > 0) // any element to process?
+  assemble();
+  pollfd fds[2] = { { notify, POLLIN, 0 }, { 0, POLLIN, 0 } };
+  alignas(inotify_event) char buf[4096];
+  int timeout = -1; // a change is assembled after 20ms of quiet: saving may take several steps
+  for (;;)
   {
-    // always parse for...
-    if (src[ep+elen-1] == ':'); // ignore label definitions in pass 2
-    else if (src[ep] == '#') // handle all preprocessor commands
-    {
-      if (elen == 5)
-      {
-        if (src.substr(ep+1, 4) == "mute") isemit = false;
-        else if (src.substr(ep+1, 4) == "emit") isemit = true;
-        else if (src.substr(ep+1, 4) == "page")
+    int n = poll(fds, 2, timeout);
+    if (n == 0) { timeout = -1; assemble(); continue; }
+    if (n < 0) return 1;
+    if (fds[0].revents & POLLIN)
+      for (ssize_t len; (len = read(notify, buf, sizeof(buf))) > 0;)
+        for (char* p = buf; p < buf + len; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len)
         {
-          int delta = (-(pc & 0xff)) & 0xff;
-          pc += delta;
-          if (isemit) hex.SetAddress(hex.GetAddress() + delta);
+          const inotify_event& e = *reinterpret_cast<inotify_event*>(p);
+          if (e.len > 0 && files.count((std::filesystem::path(dirs[e.wd]) / e.name).string())) timeout = 20;
         }
-      }
-      else if (elen == 4 && src.substr(ep+1, 3) == "org")
-      {
-        ep += elen; elen = findelem(src, ep); // this #org 0x. is already known to be parsable from pass 1
-        size_t k = src.find_first_not_of("0123456789abcdefABCDEF", ep+2);
-        if (k == std::string::npos) k = ep + elen;
-        pc = std::stoi(src.substr(ep+2, k - (ep+2)), nullptr, 16); // always set pc...
-        if (isemit) hex.SetAddress(pc); // ... but set mc only while emitting
-      }
-      else { errors << "ERROR in line " << ln(src, ep) << ": Unknown pre-proc command.\n"; return; }
-    }
-    else // parse mode-specifically
+    if (fds[1].revents & (POLLIN | POLLHUP))
     {
-      switch (args & 0x0f) // handle different expectation modes
+      ssize_t len = read(0, buf, sizeof(buf));
+      if (len <= 0) return 0; // the editor is gone
+      input.append(buf, len);
+      for (size_t eol; (eol = input.find('\n')) != std::string::npos; input.erase(0, eol + 1))
       {
-        case 0: // expect anything (including strings, opcodes, constants)
-        {
-          if ((src[ep] == '\'' || src[ep] == '\"') && elen > 3) // string, but not a single char, matching quotes are tested earlier
-            for (int i=ep+1; i<ep+elen-1; i++) { pc++; if (isemit) hex.Emit(src[i]); }
-          else // expression (may include single chars, mnemonics, ...)
-          {
-            if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, true, lsb, msb, hex)) return;
-            if (isop) { args = ARGS[lsb]; pc++; if (isemit) hex.Emit(lsb); } // pure mnemonic allowed here
-            else if (islsb) { pc++; if (isemit) hex.Emit(lsb); }
-            else if (ismsb) { pc++; if (isemit) hex.Emit(msb); }
-            else if (isword) { pc+=2; if (isemit) { hex.Emit(lsb); hex.Emit(msb); } } // ... but not islsb or ismsb
-            else
-            {
-              if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; if (isemit) hex.Emit(lsb); }
-              else { errors << "ERROR in line " << ln(src, ep) << ", lsb=" << lsb << ", msb=" << msb << ": Expression size unclear.\n"; return; }
-            }
-          }
-          break;
-        }
-        case 1: // expect byte argument
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, true, lsb, msb, hex)) return;
-          if (islsb) { pc++; if (isemit) hex.Emit(lsb); }
-          else if (ismsb) { pc++; if (isemit) hex.Emit(msb); }
-          else if (isop || isword) { errors << "ERROR in line " << ln(src, ep) << ": Expecting byte expression.\n"; return; }
-          else
-          {
-            if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; if (isemit) hex.Emit(lsb); }
-            else { errors << "ERROR in line " << ln(src, ep) << ": Expecting byte expression.\n"; return; }
-          }
-          args >>= 4;
-          break;
-        }
-        case 2: // zero page argument
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, true, lsb, msb, hex)) return;
-          if (isop || ismsb) { errors << "ERROR in line " << ln(src, ep) << ": Expecting a zero-page argument.\n"; return; }
-          else if (islsb || msb == 0x00) { pc++; if (isemit) hex.Emit(lsb); }
-          else { errors << "ERROR in line " << ln(src, ep) << ": Expecting a zero-page argument.\n"; return; }
-          args >>= 4;
-          break;
-        }
-        case 3: // expect word
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, true, lsb, msb, hex)) return;
-          if (isop) { errors << "ERROR in line " << ln(src, ep) << ": Expecting a word argument.\n"; return; } // redundant
-          else if (islsb) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(lsb); }
-          else if (ismsb) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(msb); }
-          else if (isword) { pc+=2; args >>= 4; if (isemit) { hex.Emit(lsb); hex.Emit(msb); } }
-          else if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(lsb); }
-          else { errors << "ERROR in line " << ln(src, ep) << ": Unclear word argument.\n"; return; } // { pc+=2; args >>= 4; if (isemit) { hex.Emit(lsb); hex.Emit(msb); } }
-          break;
-        }
-        case 4: // expect fast jump
-        {
-          if (!parseExpr(src, ep, elen, errors, labels, labelpc, isop, isword, islsb, ismsb, true, lsb, msb, hex)) return;
-          if (isop || ismsb || (!islsb && msb != ((pc >> 8) & 0xff) && msb != 0x00 ))
-            { errors << "ERROR in line " << ln(src, ep) << ": Invalid fast jump.\n"; return; }
-          else { pc++; if (isemit) hex.Emit(lsb); }
-          args >>= 4;
-          break;
-        }
+        std::string_view line = std::string_view(input).substr(0, eol);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        if (!command(line)) return 0;
       }
     }
-    ep += elen; // hop over the processed element
   }
-
-  if (elen == -1) { errors << "ERROR in line " << ln(src, ep) << ": Invalid element.\n"; return; }
-  // check whether all of the lastly expected arguments were received
-  if (args != 0) { errors << "ERROR in line " << ln(src, ep) << ": Missing argument.\n"; return; }
 }
+#endif
 
 int main(int argc, char *argv[])
 {
-  bool dosym = false;																 // by default don't output a symbol table
-  std::string symtag = "";													 // by default don't use any symbol tag
+  Options opt;                                       // by default output Intel HEX and no symbol table
+  DiagFormat format = DIAG_TEXT;                     // format of error messages
   int filenamepos = 0;															 // extract possible -s parameter and filename
+  bool isbatch = false;                              // assemble all given files into files of their own
+  bool iswatch = false;                              // assemble the file whenever it changes
+  std::vector<std::string> sources;                  // files of the batch
+  std::string outdir;                                // directory of the batch output, default: next to the source
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::string cachedir = AsmCache::DefaultDir();     // "": no cache
+  long long cachesize = 64 << 20;                    // bytes
+  bool cachestats = false;
+  bool isjsonstats = false;                          // --stats as a JSON object
+  std::string exportfile;                            // binary symbol file, default: <source>.msym
   for (int i=1; i<argc; i++)												 // index zero contains "asm" itself
   {
-    if (argv[i][0] == '-' && argv[i][1] == 's')	{ dosym = true; symtag = std::string(&argv[i][2]); }
+    if (strcmp(argv[i], "--all-errors") == 0) opt.allerrors = true;
+    else if (strcmp(argv[i], "--diag=gnu") == 0) format = DIAG_GNU;
+    else if (strcmp(argv[i], "--diag=json") == 0) format = DIAG_JSON;
+    else if (strcmp(argv[i], "--format=hex") == 0) opt.format = OUT_HEX;
+    else if (strcmp(argv[i], "--format=srec") == 0) opt.format = OUT_SREC;
+    else if (strcmp(argv[i], "--format=bin") == 0) opt.format = OUT_BIN;
+    else if (strcmp(argv[i], "--format=seg") == 0) opt.format = OUT_SEG;
+    else if (strncmp(argv[i], "--base=", 7) == 0) opt.binbase = strtol(&argv[i][7], nullptr, 0) & 0xffff;
+    else if (strncmp(argv[i], "--fill=", 7) == 0) opt.fill = strtol(&argv[i][7], nullptr, 0);
+    else if (strncmp(argv[i], "--reclen=", 9) == 0) opt.reclen = std::clamp(int(strtol(&argv[i][9], nullptr, 0)), 1, 255);
+    else if (strncmp(argv[i], "--merge=", 8) == 0) opt.mergegap = std::max(0, int(strtol(&argv[i][8], nullptr, 0)));
+    else if (strcmp(argv[i], "--report") == 0) opt.report = true;
+    else if (strcmp(argv[i], "--relax") == 0) opt.relax = true;
+    else if (strcmp(argv[i], "--optimize") == 0) opt.optimize = true;
+    else if (strcmp(argv[i], "--loop-weight") == 0) opt.loopweight = true;
+    else if (strcmp(argv[i], "--list") == 0) opt.listing = true;
+    else if (strcmp(argv[i], "--strip") == 0) opt.strip = true;
+    else if (strcmp(argv[i], "--stats") == 0) opt.stats = true;
+    else if (strcmp(argv[i], "--stats=json") == 0) { opt.stats = true; isjsonstats = true; }
+    else if (strcmp(argv[i], "--pack") == 0) opt.pack = true;
+    else if (strncmp(argv[i], "--pack=", 7) == 0) { opt.pack = true; opt.packaddr = strtol(&argv[i][7], nullptr, 0) & 0xffff; }
+    else if (strcmp(argv[i], "--batch") == 0) isbatch = true;
+    else if (strcmp(argv[i], "--watch") == 0) iswatch = true;
+    else if (strncmp(argv[i], "--jobs=", 7) == 0) threads = std::max(1, atoi(&argv[i][7]));
+    else if (strncmp(argv[i], "--out-dir=", 10) == 0) outdir = &argv[i][10];
+    else if (strncmp(argv[i], "--cache=", 8) == 0) cachedir = &argv[i][8];
+    else if (strcmp(argv[i], "--no-cache") == 0) cachedir.clear();
+    else if (strncmp(argv[i], "--cache-size=", 13) == 0) cachesize = std::max(0LL, atoll(&argv[i][13])) << 20;
+    else if (strcmp(argv[i], "--cache-stats") == 0) cachestats = true;
+    else if (strcmp(argv[i], "--export") == 0) opt.doexport = true;
+    else if (strncmp(argv[i], "--export=", 9) == 0) { opt.doexport = true; exportfile = &argv[i][9]; }
+    else if (argv[i][0] == '-' && argv[i][1] == 's')	{ opt.dosym = true; opt.symtag = &argv[i][2]; }
     else filenamepos = i;														 // nope, plain filename => remember it's index inside argv[]
   }
 
+  opt.threads = threads;
+  AsmCache cache(cachedir, cachesize);
+  auto finish = [&](int code) { cache.Evict(); if (cachestats) cache.PrintStats(std::cerr); return code; };
+  if (isbatch) // all plain arguments are files, patterns or @manifests
+  {
+    for (int i=1; i<argc; i++) if (argv[i][0] != '-') addSources(sources, argv[i]);
+    if (!sources.empty()) return finish(AssembleBatch(sources, opt, format, outdir, threads, cache));
+  }
+
+  if (iswatch && filenamepos > 0)
+  {
+#ifdef __linux__
+    return Watch(argv[filenamepos], opt, outdir, exportfile);
+#else
+    std::cout << "ERROR: --watch is available on Linux only.\n"; return 1;
+#endif
+  }
+
 	if (filenamepos > 0)															 // does a valid argument position of a filename exist?
 	{
-		std::ifstream file(argv[filenamepos]);
-		if (file.is_open())
+		AsmContext ctx;
+		if (ctx.AssembleFile(argv[filenamepos], opt, &cache))
 		{
-      std::stringstream hexout, errors;
-      std::string source;
-      std::getline(file, source, '\0');
-      file.close();
-      Assembler(source, hexout, errors, dosym, symtag);
-      if (errors.str().size() == 0) std::cout << hexout.str(); else std::cout << errors.str();
+      if (ctx.ErrorCount() == 0 && opt.doexport)
+      {
+        if (exportfile.empty()) exportfile = std::filesystem::path(argv[filenamepos]).replace_extension(".msym").string();
+        std::ofstream symfile(exportfile, std::ios::binary);
+        if (!symfile.write(ctx.Symbols().data(), ctx.Symbols().size()))
+          { std::cout << ("ERROR: Can't write \"" + exportfile + "\".\n"); return finish(0); }
+      }
+      if (ctx.ErrorCount() == 0)
+      {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY); // binary formats must not be altered
+#endif
+        fwrite(ctx.Output().data(), 1, ctx.Output().size(), stdout);
+        ctx.PrintNotes(std::cerr);
+      }
+      else ctx.PrintErrors(std::cout, format, argv[filenamepos]);
+      if (opt.stats) ctx.PrintStats(std::cerr, isjsonstats);
 		}
 		else std::cout << ("ERROR: Can't open \"" + std::string(argv[filenamepos]) + "\".\n");
+    return finish(0);
 	}
   else
   {
 	std::cout << "Minimal 64x4 Redux Assembler by C. Herting (slu4) 2026\n\n";
-    std::cout << "Usage: asm <sourcefile> [-s[<tag>]]\n\n";
+    std::cout << "Usage: asm <sourcefile> [-s[<tag>]] [options]\n\n";
     std::cout << "assembles a <sourcefile> to machine code and outputs\n";
     std::cout << "the result in 'Intel HEX' format to the console.\n\n";
-    std::cout << "  -s[<tag>]  appends a list of symbolic constants\n";
-    std::cout << "             [starting with <tag>] and their values.\n";
+    std::cout << "  -s[<tag>]     appends a list of symbolic constants\n";
+    std::cout << "                [starting with <tag>] and their values.\n";
+    std::cout << "  --all-errors  reports all errors, not only the first.\n";
+    std::cout << "  --diag=gnu    reports errors as 'file:line:col: error: ..'\n";
+    std::cout << "  --diag=json   reports errors as JSON lines.\n";
+    std::cout << "  --format=hex|srec|bin|seg  output format: Intel HEX,\n";
+    std::cout << "                Motorola S-record, raw binary image or\n";
+    std::cout << "                segment list (addr, len, data, LE).\n";
+    std::cout << "  --base=<x>    first address of a binary image.\n";
+    std::cout << "  --fill=<x>    value of gaps in a binary image.\n";
+    std::cout << "  --reclen=<n>  data bytes per record (max. 19 for MinOS).\n";
+    std::cout << "  --merge=<n>   address-ordered records, gaps up to <n>\n";
+    std::cout << "                bytes are padded with the fill value.\n";
+    std::cout << "  --report      prints line count and upload time.\n";
+    std::cout << "  --relax       turns jumps into fast page-local jumps\n";
+    std::cout << "                wherever they fit.\n";
+    std::cout << "  --optimize    rewrites instructions into faster\n";
+    std::cout << "                equivalents.\n";
+    std::cout << "  --loop-weight ranks '#var' references in loops higher.\n";
+    std::cout << "  --list        prints the lines of each macro expansion.\n";
+    std::cout << "  --strip       leaves out unreachable code and data.\n";
+    std::cout << "  --stats[=json] prints phase times and source statistics.\n";
+    std::cout << "  --pack[=<x>]  outputs the compressed image and an\n";
+    std::cout << "                unpacker [at <x>], start it with 'run'.\n";
+    std::cout << "  --batch <files, patterns or @lists> assembles each\n";
+    std::cout << "                file to <file>.hex (or .s19 .bin .seg .sym).\n";
+    std::cout << "  --jobs=<n>    number of threads (batch or large files).\n";
+    std::cout << "  --out-dir=<d> directory of the batch output files.\n";
+    std::cout << "  --watch       assembles to <file>.hex whenever the source\n";
+    std::cout << "                changes, answers editor queries on stdin.\n";
+    std::cout << "  --cache=<d>   build cache directory (default: $ASM_CACHE\n";
+    std::cout << "                or ~/.cache/minimal-asm).\n";
+    std::cout << "  --no-cache    always assembles, nothing is cached.\n";
+    std::cout << "  --cache-size=<n> cache capacity in MB (default: 64).\n";
+    std::cout << "  --cache-stats prints hits, misses and cache size.\n";
+    std::cout << "  --export[=<f>] writes a binary symbol file for\n";
+    std::cout << "                '#import' (default: <sourcefile>.msym).\n";
   }
   return 0;
 }
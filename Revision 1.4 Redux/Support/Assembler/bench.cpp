@@ -0,0 +1,281 @@
+// Throughput benchmark of the next 'Minimal 64x4 Redux Smart Assembler'
+// by Carsten Herting (slu4) 2025, last update 17.10.2026
+
+// Build with: g++ bench.cpp -std=c++17 -O2 -pthread -obench -s (includes minasm.cpp to time its phases separately)
+
+// Assembles the shipped programs and generated sources of 1KB..100MB and reports time, MB/s, tokens/s and peak memory
+// of every phase. --json writes one JSON object per source and phase, --compare reports phases slower than before.
+// Small sources of fixed output are checked first, a different output counts as a regression.
+
+#pragma GCC diagnostic ignored "-Wsubobject-linkage" // minasm.cpp is meant to be compiled on its own
+#include "minasm.cpp"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <map>
+
+struct Phase { std::string source, phase, unit; long long size; double ms, mbs, rate; long long peakkb; }; // one result
+
+long long peakReset() // returns the peak memory in KB since the last call (0: unknown) and starts measuring anew
+{
+  long long peak = 0;
+#ifdef __linux__
+  {
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);) if (line.compare(0, 6, "VmHWM:") == 0) peak = atoll(line.c_str() + 6);
+  }
+  std::ofstream("/proc/self/clear_refs") << "5"; // resets the peak resident set size (VmHWM)
+#endif
+  return peak;
+}
+
+template<class F> double bestOf(F run) // fastest of several runs in ms: until 300ms have passed, but at most 20
+{
+  double best = 1e30, total = 0;
+  for (int n=0; n == 0 || (n < 20 && total < 300); n++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    best = std::min(best, ms); total += ms;
+  }
+  return best;
+}
+
+// Synthetic source of about 'size' bytes: label-, comment-, data-, expression-heavy or fragmented by '#org'
+std::string generate(const std::string& kind, long long size)
+{
+  std::mt19937 gen(1); // the same source in every build
+  auto rng = [&gen] { return int(gen() & 0x7fffffff); };
+  std::string src = "#org 0x8000\n";
+  src.reserve(size + 256);
+  char line[256];
+  int i = 0;
+  for (; src.size() < size_t(size); i++)
+  {
+    int j = rng() % (i + 1); // an earlier label
+    if (kind == "labels") snprintf(line, sizeof(line), "l%d: JPA l%d\n", i, rng() % 2 ? i + 1 : j);
+    else if (kind == "comments")
+      snprintf(line, sizeof(line), i % 4 ? "; line %d is a comment, the scanner skips it in one go\n" : "  NOP ; %d\n", i);
+    else if (kind == "data")
+    {
+      int n = 0;
+      if (i % 8 == 0) n = snprintf(line, sizeof(line), "  \"Hello, Minimal! %d\"", i);
+      for (int b=0; b<16; b++) n += snprintf(line + n, sizeof(line) - n, " 0x%02x", rng() & 0xff);
+      snprintf(line + n, sizeof(line) - n, "\n");
+    }
+    else if (kind == "exprs")
+      snprintf(line, sizeof(line), "e%d: LDI <e%d+%d LDB e%d+0x10-%d SDB e%d-1+0x2000\n  LDI >e%d JPA e%d+3-3\n", i, j, rng() % 64,
+               j, rng() % 16, j, j, i + 1);
+    else if (kind == "orgs")
+      snprintf(line, sizeof(line), "#org 0x%04x\n  LDI %d SDB 0x%04x NOP\n", rng() & 0xffff, rng() % 256, rng() & 0xffff);
+    else return "";
+    src += line;
+  }
+  if (kind == "labels") src += "l" + std::to_string(i) + ":\n"; // the last forward reference
+  if (kind == "exprs") src += "e" + std::to_string(i) + ":\n";
+  return src;
+}
+
+// Times the phases of one source: reading, lexing (findelem, splitExpr, opCode), both passes, symbol lookups, HEX
+// output and the whole assembly by a warm AsmContext
+void measure(const std::string& name, const std::string& path, std::string_view src, const Options& opt, std::vector<Phase>& results)
+{
+  std::vector<Phase> phases;
+  auto add = [&](const char* phase, double ms, double mb, double items, const char* unit, long long peak)
+    { phases.push_back({ name, phase, unit, (long long)src.size(), ms, mb / ms * 1e3, items / ms * 1e3, peak }); };
+  double mb = src.size() / 1e6;
+
+  if (!path.empty())
+  {
+    peakReset();
+    double ms = bestOf([&]
+    {
+      SourceFile file(path.c_str());
+      volatile char sum = 0; std::string_view text = file.Text();
+      for (size_t p=0; p<text.size(); p+=4096) sum += text[p]; // touches every page
+    });
+    add("read", ms, mb, 0, "", peakReset());
+  }
+
+  TokenStream ts;
+  double ms = bestOf([&] { ts.tokens.clear(); ts.terms.clear(); Tokenize(src, ts); });
+  double tokens = ts.tokens.size() - 1;
+  add("lex", ms, mb, tokens, "tokens", peakReset());
+
+  Workspace ws; std::string out; Diagnostics diag(src);
+  ws.lexed = ts;
+  ms = bestOf([&] { out.clear(); diag.Reset(src, opt.allerrors); ws.islexed = true; Assembler(ws, src, out, diag, opt, path); });
+  add("passes", ms, mb, tokens, "tokens", peakReset());
+  int errors = diag.Count();
+
+  std::vector<std::string_view> defs, refs; // label definitions and references
+  for (const Token& tok : ts.tokens)
+  {
+    if (tok.kind == TK_LABEL) defs.push_back(src.substr(tok.pos, tok.len - 1));
+    for (int k=tok.term; k<tok.term+tok.nterms; k++) if (ts.terms[k].type == Term::LABEL) refs.push_back(src.substr(ts.terms[k].pos, ts.terms[k].len));
+  }
+  if (!defs.empty())
+  {
+    SymbolTable symbols; volatile int found = 0;
+    ms = bestOf([&]
+    {
+      symbols.Clear();
+      for (std::string_view def : defs) symbols.Insert(def, 0);
+      for (std::string_view ref : refs) found += symbols.Find(ref) != -1;
+    });
+    add("symbols", ms, 0, defs.size() + refs.size(), "lookups", peakReset());
+  }
+
+  const Image& image = ws.printers[opt.format]->GetImage();
+  if (image.Highest() >= 0)
+  {
+    double bytes = 0;
+    for (int a=image.Lowest(); a<=image.Highest(); a++) bytes += image.IsUsed(a);
+    Options hexopt = opt; hexopt.format = OUT_HEX;
+    std::string hexout; HexPrinter hex(hexout, hexopt);
+    ms = bestOf([&]
+    {
+      hex.Reset(hexout, hexopt); hexout.clear();
+      for (int a=image.Lowest(); a<=image.Highest(); a++)
+        if (image.IsUsed(a)) { if (hex.GetAddress() != a) hex.SetAddress(a); hex.Emit(image.Read(a)); }
+      hex.Finish();
+    });
+    add("output", ms, bytes / 1e6, bytes, "bytes", peakReset());
+  }
+
+  AsmContext ctx;
+  ms = bestOf([&] { ctx.Assemble(src, opt, path); });
+  add("total", ms, mb, tokens, "tokens", peakReset());
+
+  for (Phase& p : phases)
+  {
+    char row[200], rate[40] = "";
+    if (!p.unit.empty()) snprintf(rate, sizeof(rate), "%9.2f M%s/s", p.rate / 1e6, p.unit.c_str());
+    snprintf(row, sizeof(row), "%-34s %10lld %-8s %10.3f ms %9.1f MB/s %-22s %8lld KB%s\n", p.source.c_str(), p.size,
+             p.phase.c_str(), p.ms, p.mbs, rate, p.peakkb, errors && p.phase == "passes" ? "  (with errors)" : "");
+    std::cout << row << std::flush;
+    results.push_back(p);
+  }
+}
+
+struct Check { const char* name; const char* src; bool isrelax; const char* hex; }; // source and its expected output
+const Check CHECKS[] =
+{
+  { "local labels of #macro and #rep", "#org 0x8000\n#macro wait n\n.l: DEC BNE .l\nLDI n\n#endm\nwait 5\nwait 6\n"
+    "#rep 2 i\n.x: LDI <.x+i JPA .x\n#endr\n", false,
+    ":10800000AA5E00807605AA5E06807606760C660C6F\n:068010008076126611806B\n:00000001FF\n" },
+  { "--relax keeps the entries of a jump table", "#org 0x8000\n_a: JPA start\n_b: JPA start\nstart: BNE start RTS\n", true,
+    ":0980000066068066068055066BD9\n:00000001FF\n" },
+  { "--relax keeps the jumps of code addressed by label+offset", "#org 0x8000\npatch: BNE near\nLDI 0x00\n"
+    "MIB 0x42,patch+4\nnear: RTS\n", true, ":0A8000005E09807600854204806B63\n:00000001FF\n" },
+};
+
+int check() // assembles the CHECKS, returns the number of different outputs
+{
+  int failed = 0;
+  AsmContext ctx;
+  for (const Check& c : CHECKS)
+  {
+    Options opt; opt.relax = c.isrelax;
+    ctx.Assemble(c.src, opt);
+    if (ctx.Output() == c.hex && ctx.ErrorCount() == 0) continue;
+    std::cout << "CHECK FAILED: " << c.name << "\n" << ctx.Output();
+    ctx.PrintErrors(std::cout, DIAG_TEXT, "check");
+    failed++;
+  }
+  std::cout << std::size(CHECKS) - failed << " of " << std::size(CHECKS) << " checks passed.\n";
+  return failed;
+}
+
+std::string field(const std::string& json, const std::string& key) // value of a field of one of our own JSON lines
+{
+  size_t p = json.find("\"" + key + "\":");
+  if (p == std::string::npos) return "";
+  p += key.size() + 3;
+  if (json[p] == '\"') return json.substr(p + 1, json.find('\"', p + 1) - p - 1);
+  return json.substr(p, json.find_first_of(",}", p) - p);
+}
+
+long long parseSize(const char* s) { char* end; long long n = strtoll(s, &end, 0); return n * (*end == 'K' ? 1000 : *end == 'M' ? 1000000 : 1); }
+
+int main(int argc, char *argv[])
+{
+  Options opt;
+  opt.allerrors = true;                              // sources of Revision 1.1 (another ISA) pass through as a whole
+  long long maxsize = 100000000;                     // largest generated source
+  std::vector<std::string> corpus;                   // directories of real programs
+  std::string jsonfile, comparefile;
+  double tolerance = 10;                             // percent a phase may be slower than before
+  bool iscorpus = true;
+  for (int i=1; i<argc; i++)
+  {
+    if (strncmp(argv[i], "--max=", 6) == 0) maxsize = parseSize(&argv[i][6]);
+    else if (strncmp(argv[i], "--corpus=", 9) == 0) corpus.push_back(&argv[i][9]);
+    else if (strcmp(argv[i], "--no-corpus") == 0) iscorpus = false;
+    else if (strncmp(argv[i], "--json=", 7) == 0) jsonfile = &argv[i][7];
+    else if (strncmp(argv[i], "--compare=", 10) == 0) comparefile = &argv[i][10];
+    else if (strncmp(argv[i], "--tolerance=", 12) == 0) tolerance = atof(&argv[i][12]);
+    else if (strncmp(argv[i], "--jobs=", 7) == 0) opt.threads = std::max(1, atoi(&argv[i][7]));
+    else
+    {
+      std::cout << "Usage: bench [--max=<size>[K|M]] [--corpus=<dir>]... [--no-corpus] [--jobs=<n>]\n";
+      std::cout << "             [--json=<file>] [--compare=<file> [--tolerance=<percent>]]\n";
+      return 0;
+    }
+  }
+  if (corpus.empty()) corpus = { "../../Programs/asm", "../../../Revision 1.1/Programs/asm" };
+
+  int regressions = check();
+  std::vector<Phase> results;
+  if (iscorpus)
+    for (const std::string& dir : corpus)
+    {
+      std::error_code ec; std::vector<std::string> files;
+      for (const auto& entry : std::filesystem::directory_iterator(dir, ec))
+        if (entry.path().extension() == ".asm") files.push_back(entry.path().string());
+      std::sort(files.begin(), files.end());
+      for (const std::string& path : files)
+      {
+        SourceFile file(path.c_str());
+        if (file.IsOpen()) measure(path, path, file.Text(), opt, results);
+      }
+    }
+  for (const char* kind : { "labels", "comments", "data", "exprs", "orgs" })
+    for (long long size = 1000; size <= maxsize; size *= 10)
+    {
+      std::string src = generate(kind, size), suffix = size >= 1000000 ? std::to_string(size / 1000000) + "M" : std::to_string(size / 1000) + "K";
+      measure(std::string("gen/") + kind + "-" + suffix, "", src, opt, results);
+    }
+
+  if (!jsonfile.empty())
+  {
+    std::ofstream json(jsonfile);
+    for (const Phase& p : results)
+      json << "{\"version\":\"" << VERSION << "\",\"source\":\"" << p.source << "\",\"size\":" << p.size << ",\"phase\":\"" << p.phase
+           << "\",\"ms\":" << p.ms << ",\"mb_s\":" << p.mbs << ",\"per_s\":" << p.rate << ",\"unit\":\"" << p.unit
+           << "\",\"peak_kb\":" << p.peakkb << "}\n";
+  }
+  if (!comparefile.empty())
+  {
+    std::ifstream json(comparefile);
+    std::map<std::string, double> before; // source and phase -> ms
+    int slower = 0;
+    for (std::string line; std::getline(json, line);) before[field(line, "source") + " " + field(line, "phase")] = atof(field(line, "ms").c_str());
+    for (const Phase& p : results)
+    {
+      auto it = before.find(p.source + " " + p.phase);
+      if (it == before.end() || it->second < 0.05 || p.ms <= it->second * (1 + tolerance / 100)) continue; // shorter: noise
+      char row[160];
+      snprintf(row, sizeof(row), "SLOWER: %s %s %.3f ms -> %.3f ms (%+.0f%%)\n", p.source.c_str(), p.phase.c_str(), it->second,
+               p.ms, (p.ms / it->second - 1) * 100);
+      std::cout << row;
+      slower++;
+    }
+    regressions += slower;
+    std::cout << slower << " of " << results.size() << " phases are more than " << tolerance << "% slower.\n";
+  }
+  return regressions > 0;
+}
@@ -0,0 +1,3413 @@
+// Library of the next 'Minimal 64x4 Redux Smart Assembler' (interface: minasm.h, change log: asm.cpp)
+// by Carsten Herting (slu4) 2025, last update 17.10.2026
+
+// Build with: g++ -c minasm.cpp -std=c++17 -O2 -pthread (the assembler: see asm.cpp)
+
+#include "minasm.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <atomic>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <array>
+#include <cmath>
+#ifdef _WIN32
+  #include <io.h>
+  #include <fcntl.h>
+#else // POSIX memory-mapped source files
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/resource.h>
+#endif
+
+namespace { // everything but the interface of minasm.h is internal
+
+constexpr char VERSION[] = "17.10.2026-20"; // change with every change of the output, part of the cache key
+
+// Minimal 64x4 Redux 1.4 mnemonic tokens Feb 14th 2025
+constexpr char MNEMONICS[256][4] // Index = OpCode
+{
+  "NOP","OUT","INT","INK","WIN","LL0","LL1","LL2","LL3","LL4","LL5","LL6","LL7","RL0","RL1","RL2",
+  "RL3","RL4","RL5","RL6","RL7","RR1","LR0","LR1","LR2","LR3","LR4","LR5","LR6","LR7","LLZ","LLB",
+  "LLV","LLW","LLQ","LLL","LRZ","LRB","RLZ","RLB","RLV","RLW","RLQ","RLL","RRZ","RRB","NOT","NOZ",
+  "NOB","NOV","NOW","NOQ","NEG","NEZ","NEB","NEV","NEW","NEQ","ANI","ANZ","ANB","ANT","ANR","ZAN",
+  "BAN","TAN","RAN","ORI","ORZ","ORB","ORT","ORR","ZOR","BOR","TOR","ROR","XRI","XRZ","XRB","XRT",
+  "XRR","ZXR","BXR","TXR","RXR","FNE","FEQ","FCC","FCS","FPL","FMI","FGT","FLE","FPA","BNE","BEQ",
+  "BCC","BCS","BPL","BMI","BGT","BLE","JPA","JPR","JAR","JPS","JAS","RTS","PHS","PLS","LDS","SDS",
+  "RDB","RDR","RAP","RZP","WDB","WDR","LDI","LDZ","LDB","LDT","LDR","LAP","LAB","LZP","LZB","SDZ",
+  "SDB","SDT","SDR","SZP","MIZ","MIB","MIT","MIR","MIV","MIW","MZZ","MZB","MZT","MZR","MBZ","MBB",
+  "MBT","MBR","MTZ","MTB","MTT","MTR","MRZ","MRB","MRT","MRR","MVV","MWV","CLD","CLZ","CLB","CLV",
+  "CLW","CLQ","CLL","CL5","INC","INZ","INB","INV","INW","INQ","DEC","DEZ","DEB","DEV","DEW","DEQ",
+  "ADI","ADZ","ADB","ADT","ADR","ZAD","BAD","TAD","RAD","ADV","ADW","ADQ","AIZ","AIB","AIT","AIR",
+  "AIV","AIW","AIQ","AZZ","AZT","AZV","AZQ","ABB","ABW","ATZ","ATT","AVV","SUI","SUZ","SUB","SUT",
+  "SUR","ZSU","BSU","TSU","RSU","SUV","SUW","SUQ","SIZ","SIB","SIT","SIR","SIV","SIW","SIQ","SZZ",
+  "SZT","SZV","SZQ","SBB","SBW","STZ","STT","SVV","CPI","CPZ","CPB","CPT","CPR","CIZ","CIB","CIT",
+  "CIR","CIV","CIW","CZZ","CZT","CBB","CTZ","CTT","CVV","ACI","ACZ","ZAC","SCI","SCZ","ZSC","???",
+};
+
+// argument info: bits0-3: argtype1, bits 4-7: argtype2
+// types: 0=none, 1=expect byte, 2=zero page, 3=expect word, 4=fast jump
+const std::vector<int> ARGS // Index = OpCode
+{
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03,
+  0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x00, 0x02,
+  0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02, 0x01, 0x02, 0x03, 0x02, 0x03, 0x02,
+  0x03, 0x02, 0x03, 0x01, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x01, 0x02, 0x03, 0x02,
+  0x03, 0x02, 0x03, 0x02, 0x03, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x03, 0x03,
+  0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x00, 0x00, 0x00, 0x01, 0x01,
+  0x13, 0x03, 0x03, 0x32, 0x13, 0x03, 0x01, 0x02, 0x03, 0x02, 0x03, 0x01, 0x03, 0x12, 0x32, 0x02,
+  0x03, 0x02, 0x03, 0x12, 0x21, 0x31, 0x21, 0x31, 0x23, 0x33, 0x22, 0x32, 0x22, 0x32, 0x23, 0x33,
+  0x23, 0x33, 0x22, 0x32, 0x22, 0x32, 0x23, 0x33, 0x23, 0x33, 0x22, 0x23, 0x00, 0x02, 0x03, 0x02,
+  0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02, 0x00, 0x02, 0x03, 0x02, 0x03, 0x02,
+  0x01, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x21, 0x31, 0x21, 0x31,
+  0x21, 0x31, 0x21, 0x22, 0x22, 0x22, 0x22, 0x33, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x03, 0x02,
+  0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x03, 0x02, 0x21, 0x31, 0x21, 0x31, 0x21, 0x31, 0x21, 0x22,
+  0x22, 0x22, 0x22, 0x33, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x03, 0x02, 0x03, 0x21, 0x31, 0x21,
+  0x31, 0x23, 0x33, 0x22, 0x22, 0x33, 0x22, 0x22, 0x22, 0x01, 0x02, 0x02, 0x01, 0x02, 0x02, 0x00,
+};
+
+// clock cycles of an instruction: its microcode steps up to the one that resets the step counter (IC), taken from
+// microcode_def.csv via microcode_rom.csv (flag-dependent instructions: the longer variant, NOP: all 16 steps)
+constexpr uint8_t CYCLES[256] // Index = OpCode
+{
+  16,  7,  3,  4,  6,  2,  3,  4,  5,  6,  7,  8,  9,  2,  3,  4,
+   5,  6,  7,  8,  9, 10,  2, 10, 15, 15, 15, 15, 13,  5,  4,  6,
+   6,  8, 10, 12, 11, 13,  4,  6,  6,  8, 10, 12, 11, 13,  4,  5,
+   7,  7,  9, 11,  4,  5,  7,  7,  9, 11,  3,  4,  6,  7,  9,  4,
+   6,  7,  9,  3,  4,  6,  7,  9,  4,  6,  7,  9,  7,  8, 10, 11,
+  13,  7, 10, 10, 13,  2,  2,  2,  2,  2,  2,  2,  2,  2,  4,  4,
+   4,  4,  4,  4,  4,  4,  4,  7,  9, 11, 14, 10,  8,  6,  6, 11,
+   8, 11,  7,  9, 14, 16,  2,  3,  5,  6,  8,  4,  7,  6,  9,  3,
+   5,  6,  8,  6,  4,  6,  7,  9,  6, 13,  5,  7,  8, 10,  7,  9,
+  10, 12,  8, 10, 11, 13, 10, 12, 13, 15,  7,  9,  3,  4,  6,  4,
+   7,  6, 11, 16,  3,  5,  7,  7,  9, 11,  3,  5,  7,  7,  9, 11,
+   3,  4,  6,  7,  9,  4,  6,  7,  9,  7,  9, 11,  5,  7,  8, 10,
+   8, 10, 12,  6,  9,  9, 13, 10, 13,  9, 12, 14,  3,  4,  6,  7,
+   9,  5,  7,  8, 10,  8, 10, 12,  5,  7,  8, 10,  8, 10, 12,  6,
+   9,  9, 13, 10, 13,  9, 12, 14,  3,  4,  6,  7,  9,  5,  7,  8,
+  10, 12, 16,  6,  9, 10,  9, 12, 14,  3,  4,  4,  3,  4,  5,  8,
+};
+
+// two-character HEX representations of all byte values
+struct HexTable { char upper[256][2], lower[256][2]; };
+constexpr HexTable makeHexTable()
+{
+  HexTable t{};
+  for (int i=0; i<256; i++)
+  {
+    t.upper[i][0] = "0123456789ABCDEF"[i >> 4]; t.upper[i][1] = "0123456789ABCDEF"[i & 15];
+    t.lower[i][0] = "0123456789abcdef"[i >> 4]; t.lower[i][1] = "0123456789abcdef"[i & 15];
+  }
+  return t;
+}
+constexpr HexTable HEXTABLE = makeHexTable();
+inline char* hex2(char* p, int b) { p[0] = HEXTABLE.upper[b][0]; p[1] = HEXTABLE.upper[b][1]; return p + 2; }
+
+class Image // model of the 64KB target address space, keeps track of emitted and multiply emitted bytes
+{
+  public:
+    Image() : data(0x10000), used(0x10000), twice(0x10000) {}
+    void Write(int addr, uint8_t b)
+    {
+      addr &= 0xffff;
+      if (used[addr]) twice[addr] = true;
+      data[addr] = b; used[addr] = true;
+      if (first < 0) first = addr;
+      lo = std::min(lo, addr); hi = std::max(hi, addr);
+    }
+    void Absorb(const Image& later) // adds an image that was emitted after this one
+    {
+      for (int a=later.lo; a<=later.hi; a++)
+        if (later.used[a]) { if (later.twice[a]) twice[a] = true; Write(a, later.data[a]); }
+      if (first < 0) first = later.first;
+    }
+    bool IsUsed(int addr) const { return used[addr]; }
+    uint8_t Read(int addr) const { return data[addr]; }
+    std::vector<std::pair<int, int>> Overlaps() const // address ranges first..last of multiply emitted bytes
+    {
+      std::vector<std::pair<int, int>> ranges;
+      for (int a=lo; a<=hi; a++)
+        if (twice[a]) { if (!ranges.empty() && ranges.back().second == a - 1) ranges.back().second = a; else ranges.push_back({ a, a }); }
+      return ranges;
+    }
+    int First() const { return first; } // first emitted address (entry point), -1: none
+    int Lowest() const { return lo; } // lowest emitted address, 0x10000: none
+    int Highest() const { return hi; } // highest emitted address, -1: none
+    void Clear() // forgets everything emitted, only the range of emitted addresses is touched
+    {
+      for (int a=lo; a<=hi; a++) used[a] = twice[a] = false;
+      first = -1; lo = 0x10000; hi = -1;
+    }
+  protected:
+    int first = -1, lo = 0x10000, hi = -1; // range of emitted addresses
+    std::vector<uint8_t> data;
+    std::vector<bool> used, twice;
+};
+
+class Printer // base of all output formats: buffers emitted bytes into records of consecutive addresses
+{
+  public:
+    Printer(std::string& out, const Options& opt) : mOut(&out), mRecLen(opt.reclen), mMerge(opt.mergegap), mFill(opt.fill) {}
+    virtual ~Printer() {}
+    virtual void Reset(std::string& out, const Options& opt) // prepares for the next output, keeping the memory
+    {
+      mOut = &out; mRecLen = opt.reclen; mMerge = opt.mergegap; mFill = opt.fill;
+      wasUsed = false; n = 0; addr = 0x2000; image.Clear();
+    }
+    void SetAddress(int laddr) { if (n > 0) flush(); addr = laddr; } // begin new record at new address
+    int GetAddress() { return addr + n; } // returns the current emission address
+    void Emit(uint8_t b) { wasUsed = true; image.Write(addr + n, b); buffer[n++] = b; if (n == mRecLen) flush(); } // emit a byte
+    virtual void Finish() // writes out all remaining data (and a trailer)
+    {
+      if (n > 0) flush();
+      if (mMerge >= 0) // address-ordered layout: coalesce all emitted data, pad gaps of up to mMerge bytes
+      {
+        for (int a = 0; a < 0x10000;)
+        {
+          if (!image.IsUsed(a)) { a++; continue; }
+          int end = a; // find the end of this run including small gaps
+          for (int k = a; k < 0x10000 && k - end <= mMerge; k++) if (image.IsUsed(k)) end = k + 1;
+          for (int r = a; r < end; r += mRecLen) // split the run into records
+          {
+            int len = std::min(mRecLen, end - r);
+            for (int i=0; i<len; i++) buffer[i] = image.IsUsed(r+i) ? image.Read(r+i) : mFill;
+            record(r, buffer, len);
+          }
+          a = end;
+        }
+      }
+    }
+    void Flush() { if (n > 0) flush(); } // ends the current record
+    void Absorb(Printer& part, const std::string& partout) // appends the flushed output of a later part of the source
+    {
+      Flush();
+      *mOut += partout; image.Absorb(part.image);
+      wasUsed |= part.wasUsed; addr = part.addr;
+    }
+    const Image& GetImage() const { return image; }
+  protected:
+    virtual void record(int laddr, const uint8_t* data, int len) = 0; // outputs a record of data at laddr
+    void flush() { if (mMerge < 0) record(addr, buffer, n); addr += n; n = 0; } // only call if buffer is non-empty!
+    bool wasUsed = false; // detect whether at least one byte was emitted
+    uint8_t buffer[255]; // emission record buffer
+    int n = 0; // number of bytes in buffer
+    int addr{ 0x2000 }; // start address of the current data in buffer
+    std::string* mOut; // emission into this output buffer
+    int mRecLen; // maximum number of data bytes per record
+    int mMerge; // -1: records in order of emission, >= 0: address-ordered records, merging gaps up to this size
+    uint8_t mFill; // value of padding bytes
+    Image image; // everything that was emitted
+};
+
+class HexPrinter : public Printer // handling output in 'Intel HEX' format
+{
+  public:
+    using Printer::Printer;
+    void Finish() override { Printer::Finish(); if (wasUsed) *mOut += ":00000001FF\n"; } // write end of hex file
+  protected:
+    void record(int laddr, const uint8_t* data, int len) override
+    {
+      char line[1 + 2*(1+2+1+255+1) + 1], *p = line; // ':', count, address, type, data, checksum, LF
+      int pch = (laddr >> 8) & 0xff, pcl = laddr & 0xff, sum = len + pch + pcl;
+      *p++ = ':'; p = hex2(p, len); p = hex2(p, pch); p = hex2(p, pcl); p = hex2(p, 0x00);
+      for (int i=0; i<len; i++) { p = hex2(p, data[i]); sum += data[i]; }
+      p = hex2(p, -sum & 0xff); *p++ = '\n';
+      mOut->append(line, p - line);
+    }
+};
+
+class SRecPrinter : public Printer // handling output in 'Motorola S-record' format (S1 data, S9 end)
+{
+  public:
+    SRecPrinter(std::string& out, const Options& opt) : Printer(out, opt) { mRecLen = std::min(mRecLen, 252); }
+    void Reset(std::string& out, const Options& opt) override { Printer::Reset(out, opt); mRecLen = std::min(mRecLen, 252); }
+    void Finish() override { Printer::Finish(); if (wasUsed) *mOut += "S9030000FC\n"; }
+  protected:
+    void record(int laddr, const uint8_t* data, int len) override
+    {
+      char line[2 + 2*(1+2+252+1) + 1], *p = line; // 'S1', count, address, data, checksum, LF
+      int pch = (laddr >> 8) & 0xff, pcl = laddr & 0xff, sum = (len + 3) + pch + pcl;
+      *p++ = 'S'; *p++ = '1'; p = hex2(p, len + 3); p = hex2(p, pch); p = hex2(p, pcl);
+      for (int i=0; i<len; i++) { p = hex2(p, data[i]); sum += data[i]; }
+      p = hex2(p, ~sum & 0xff); *p++ = '\n';
+      mOut->append(line, p - line);
+    }
+};
+
+class BinPrinter : public Printer // raw binary image from 'base' (default: lowest address) to the highest address
+{
+  public:
+    BinPrinter(std::string& out, const Options& opt) : Printer(out, opt), mBase(opt.binbase) {}
+    void Reset(std::string& out, const Options& opt) override { Printer::Reset(out, opt); mBase = opt.binbase; }
+    void Finish() override
+    {
+      Printer::Finish();
+      int lo = image.Lowest(), hi = image.Highest();
+      int start = mBase >= 0 ? mBase : lo; // bytes below the base address are not part of the image
+      for (int a=start; a<=hi; a++) *mOut += image.IsUsed(a) ? char(image.Read(a)) : char(mFill);
+    }
+  protected:
+    void record(int, const uint8_t*, int) override {} // the image is all we need
+    int mBase; // address of the first image byte, -1: lowest emitted address
+};
+
+class SegPrinter : public Printer // binary list of segments: address (LE word), length (LE word), data
+{
+  public:
+    using Printer::Printer;
+    void Reset(std::string& out, const Options& opt) override { Printer::Reset(out, opt); segaddr = seglen = 0; segstart = 0; }
+    void Finish() override { Printer::Finish(); if (seglen > 0) closeSegment(); }
+  protected:
+    void record(int laddr, const uint8_t* data, int len) override
+    {
+      for (int i=0; i<len; i++)
+      {
+        int a = (laddr + i) & 0xffff;
+        if (seglen > 0 && (a != ((segaddr + seglen) & 0xffff) || seglen == 0xffff)) closeSegment(); // not contiguous
+        if (seglen == 0) { segaddr = a; segstart = mOut->size(); mOut->append(4, '\0'); } // header is written on closing
+        *mOut += char(data[i]); seglen++;
+      }
+    }
+    void closeSegment()
+    {
+      (*mOut)[segstart] = segaddr & 0xff; (*mOut)[segstart+1] = segaddr >> 8;
+      (*mOut)[segstart+2] = seglen & 0xff; (*mOut)[segstart+3] = seglen >> 8;
+      seglen = 0;
+    }
+    int segaddr = 0, seglen = 0; // current segment
+    size_t segstart = 0; // position of the current segment's header in the output
+};
+
+std::unique_ptr<Printer> makePrinter(const Options& opt, std::string& out) // creates the output back-end
+{
+  switch (opt.format)
+  {
+    case OUT_SREC: return std::make_unique<SRecPrinter>(out, opt);
+    case OUT_BIN: return std::make_unique<BinPrinter>(out, opt);
+    case OUT_SEG: return std::make_unique<SegPrinter>(out, opt);
+    default: return std::make_unique<HexPrinter>(out, opt);
+  }
+}
+
+// Packed stream of the unpacker (greedy LZ77, runs are matches overlapping their destination):
+// 0x01..0x7f: n literal bytes follow, 0x81..0xff: copy n-0x80 bytes from the following address (LSB, MSB),
+// 0x00: continue at the following address, 0x80: jump to the following address (entry point).
+std::vector<uint8_t> packImage(const Image& img, int entry)
+{
+  const int MINMATCH = 4, MAXLEN = 127, MAXCHAIN = 64; // a match costs 3 bytes
+  std::vector<uint8_t> pack;
+  std::vector<int> head(4096, -1), prev(0x10000, -1); // hash chains of already unpacked addresses
+  auto hash = [&](int a) { return ((img.Read(a) << 16 | img.Read(a+1) << 8 | img.Read(a+2)) * 2654435761u) >> 20; };
+  auto address = [&](int code, int a) { pack.push_back(code); pack.push_back(a & 0xff); pack.push_back(a >> 8); };
+  for (int a = 0; a < 0x10000;)
+  {
+    if (!img.IsUsed(a)) { a++; continue; }
+    int end = a; while (end < 0x10000 && img.IsUsed(end)) end++; // segment a..end-1
+    address(0x00, a);
+    int lit = -1; // index of the open literal run
+    auto insert = [&](int d) { if (d + 2 < end) { int h = hash(d); prev[d] = head[h]; head[h] = d; } };
+    for (int d = a; d < end;)
+    {
+      int best = 0, from = 0;
+      if (d + MINMATCH <= end)
+        for (int s = head[hash(d)], k = 0; s >= 0 && k < MAXCHAIN; s = prev[s], k++)
+        {
+          int n = 0; // sources are unpacked already (s < d) or get unpacked by the copy itself
+          while (n < MAXLEN && d + n < end && img.IsUsed(s + n) && img.Read(s + n) == img.Read(d + n)) n++;
+          if (n > best) { best = n; from = s; }
+        }
+      if (best >= MINMATCH) { address(0x80 + best, from); lit = -1; for (int i=0; i<best; i++) insert(d++); }
+      else
+      {
+        if (lit < 0 || pack[lit] == MAXLEN) { lit = pack.size(); pack.push_back(0); }
+        pack[lit]++; pack.push_back(img.Read(d)); insert(d++);
+      }
+    }
+    a = end;
+  }
+  address(0x80, entry);
+  return pack;
+}
+
+std::string makeUnpacker(const std::vector<uint8_t>& pack, int addr) // source of the unpacker at addr, followed by the data
+{
+  char org[32];
+  snprintf(org, sizeof(org), "#org 0x%04x\n", addr);
+  std::string src = org; // PtrA 0x80: packed data, PtrB 0x83: destination, PtrC 0x86: source, Z0 0x90: counter
+  src +=
+    "          MIV unp_data,0x80\n"
+    "unp_next: LDT 0x80 SDZ 0x90 INV 0x80 LDZ 0x90            ; control byte\n"
+    "          CPI 0x80 BEQ unp_jump BCS unp_copy\n"
+    "          CPI 0x00 BEQ unp_org\n"
+    "unp_lit:  LDT 0x80 SDT 0x83 INV 0x80 INV 0x83            ; literal bytes\n"
+    "          DEZ 0x90 BNE unp_lit JPA unp_next\n"
+    "unp_copy: SUI 0x80 SDZ 0x90\n"
+    "          LDT 0x80 SDZ 0x86 INV 0x80 LDT 0x80 SDZ 0x87 INV 0x80\n"
+    "unp_run:  LDT 0x86 SDT 0x83 INV 0x86 INV 0x83            ; copy of earlier bytes\n"
+    "          DEZ 0x90 BNE unp_run JPA unp_next\n"
+    "unp_org:  LDT 0x80 SDZ 0x83 INV 0x80 LDT 0x80 SDZ 0x84 INV 0x80 JPA unp_next\n"
+    "unp_jump: LDT 0x80 SDZ 0x86 INV 0x80 LDT 0x80 SDZ 0x87 JPR 0x0086\n"
+    "unp_data:";
+  char b[8];
+  for (size_t i=0; i<pack.size(); i++) { snprintf(b, sizeof(b), "%s0x%02x", i % 32 ? " " : "\n", pack[i]); src += b; }
+  return src + "\n";
+}
+
+int findFree(const Image& img, int size) // highest free address range of the RAM for the unpacker, -1: none
+{
+  const int areas[][2] { { 0x8000, 0xf000 }, { 0x0100, 0x4000 } }; // not the VRAM, the OS or the stack
+  for (auto [lo, hi] : areas)
+    for (int a = hi - 1, free = 0; a >= lo; a--)
+    {
+      free = img.IsUsed(a) ? 0 : free + 1;
+      if (free == size) return a;
+    }
+  return -1;
+}
+
+class SymbolTable // open-addressing hash table of label definitions, names are views into the source
+{
+  public:
+    SymbolTable() : slots(1024, -1) {}
+    int Find(std::string_view name) const // returns the stable index of a label or -1 if unknown
+    {
+      uint32_t h = Hash(name);
+      for (uint32_t i = h & (slots.size()-1);; i = (i+1) & (slots.size()-1)) // linear probing
+      {
+        int k = slots[i];
+        if (k == -1) return -1;
+        if (entries[k].hash == h && entries[k].name == name) return k;
+      }
+    }
+    int Insert(std::string_view name, int value) { return Insert(name, value, Hash(name)); }
+    int Insert(std::string_view name, int value, uint32_t h) // adds a new definition, returns its index or -1 if it already exists
+    {
+      if (2*(entries.size()+1) > slots.size()) grow(); // keep the load factor below 50%
+      uint32_t i = h & (slots.size()-1);
+      for (; slots[i] != -1; i = (i+1) & (slots.size()-1))
+        if (entries[slots[i]].hash == h && entries[slots[i]].name == name) return -1;
+      slots[i] = entries.size(); entries.push_back({ name, value, h, false });
+      return slots[i];
+    }
+    void Clear() { entries.clear(); std::fill(slots.begin(), slots.end(), -1); } // keeps the memory
+    int Size() const { return entries.size(); } // indices are handed out in order of definition
+    std::string_view Name(int k) const { return entries[k].name; }
+    int Value(int k) const { return entries[k].value; }
+    void SetValue(int k, int value) { entries[k].value = value; } // moves a label (jump relaxation)
+    void Poison(int k) { entries[k].ispoisoned = true; } // marks a broken definition or an unknown name
+    bool IsPoisoned(int k) const { return entries[k].ispoisoned; }
+    int Slots() const { return slots.size(); }
+    void Probes(long long& total, int& longest) const // slots visited by looking up every symbol once
+    {
+      total = longest = 0;
+      for (size_t i=0; i<slots.size(); i++)
+        if (slots[i] != -1)
+        {
+          int n = ((i - entries[slots[i]].hash) & (slots.size()-1)) + 1; // distance from the home slot
+          total += n; longest = std::max(longest, n);
+        }
+    }
+    static uint32_t Hash(std::string_view s) // FNV-1a
+    {
+      uint32_t h = 2166136261u;
+      for (char c : s) { h ^= uint8_t(c); h *= 16777619u; }
+      return h;
+    }
+  protected:
+    void grow() // doubles the slot array and re-inserts all indices
+    {
+      std::vector<int> old(slots.size()*2, -1); slots.swap(old);
+      for (size_t k=0; k<entries.size(); k++)
+      {
+        uint32_t i = entries[k].hash & (slots.size()-1);
+        while (slots[i] != -1) i = (i+1) & (slots.size()-1);
+        slots[i] = k;
+      }
+    }
+    struct Entry { std::string_view name; int value; uint32_t hash; bool ispoisoned; };
+    std::vector<Entry> entries; // label definitions in order of appearance
+    std::vector<int> slots; // hash slots holding entry indices, -1 = empty (size is a power of 2)
+};
+
+class LineIndex // offsets of all line starts, maps source positions to line and column by binary search
+{
+  public:
+    void Build(std::string_view src)
+    {
+      starts.assign(1, 0);
+      for (size_t p = src.find('\n'); p != std::string_view::npos; p = src.find('\n', p+1)) starts.push_back(p+1);
+    }
+    int Line(int pos) const { return std::upper_bound(starts.begin(), starts.end(), pos) - starts.begin(); } // 1-based
+    int Column(int pos) const { return pos - starts[Line(pos)-1] + 1; } // 1-based
+  protected:
+    std::vector<int> starts;
+};
+
+class Diagnostics // collects error messages with their file and line and prints them sorted by position
+{
+  public:
+    Diagnostics(std::string_view source, bool collectall = false) : src(source), files(1), isall(collectall) {}
+    void Reset(std::string_view source, bool collectall) // prepares for the next assembly, keeping the memory
+    {
+      src = source; isall = collectall; isindexed = false;
+      diags.clear(); positions.clear(); notes.clear(); files.resize(1);
+    }
+    void Include(std::string_view source, int base, std::string name) // the source was extended by a file at 'base'
+    {
+      src = source; isindexed = false;
+      files.push_back({ base, std::move(name) });
+    }
+    void Error(int pos, std::string message, std::string detail = "") // detail is appended to the line number
+    {
+      if (!positions.insert(pos).second) return; // one diagnostic per element is enough
+      auto [file, line] = locate(pos);
+      diags.push_back({ pos, file, line, lines.Column(pos), std::move(message), std::move(detail) });
+    }
+    std::string Where(int pos) // "line 12" or "line 3 of lib/api.asm" for notes
+    {
+      auto [file, line] = locate(pos);
+      return "line " + std::to_string(line) + (file > 0 ? " of " + files[file].name : "");
+    }
+    void Note(std::string text) { notes.push_back(std::move(text)); } // warnings and reports without a position
+    bool Stop() const { return !isall && !diags.empty(); } // true: abort assembling after an error
+    bool IsCollecting() const { return isall; }
+    int Count() const { return diags.size(); }
+    void Visit(const std::function<void(const AsmMessage&)>& visit) // all errors sorted by position
+    {
+      std::stable_sort(diags.begin(), diags.end(), [](const Diag& a, const Diag& b) { return a.pos < b.pos; });
+      for (const Diag& d : diags) visit({ d.file > 0 ? std::string_view(files[d.file].name) : "", d.line, d.col, d.message, d.detail });
+    }
+    void Print(std::ostream& out, DiagFormat format, std::string_view filename, bool isbatch = false)
+    {
+      Visit([&](const AsmMessage& m)
+      {
+        std::string_view name = m.file.empty() ? filename : m.file;
+        switch (format)
+        {
+          case DIAG_TEXT: if (isbatch) out << filename << ": ";
+            out << "ERROR in line " << std::dec << m.line;
+            if (!m.file.empty()) out << " of " << name; // error inside an included file
+            out << m.detail << ": " << m.text << "\n"; break;
+          case DIAG_GNU: out << name << ":" << std::dec << m.line << ":" << m.column << ": error: " << m.text << "\n"; break;
+          case DIAG_JSON:
+            out << "{\"file\":\"" << escape(name) << "\",\"line\":" << std::dec << m.line << ",\"column\":" << m.column
+                << ",\"severity\":\"error\",\"message\":\"" << escape(m.text) << "\"}\n";
+            break;
+        }
+      });
+    }
+    const std::vector<std::string>& Notes() const { return notes; }
+    void PrintNotes(std::ostream& out, std::string_view prefix = "") const { for (const std::string& n : notes) out << prefix << n << "\n"; }
+  protected:
+    std::pair<int, int> locate(int pos) // file index and line, taken while the source is alive
+    {
+      if (!isindexed) { lines.Build(src); isindexed = true; }
+      int file = std::upper_bound(files.begin(), files.end(), pos, [](int p, const File& f) { return p < f.base; }) - files.begin() - 1;
+      return { file, lines.Line(pos) - lines.Line(files[file].base) + 1 };
+    }
+    static std::string escape(std::string_view s) // JSON string escaping
+    {
+      std::string e;
+      for (char c : s)
+      {
+        if (c == '\"' || c == '\\') { e += '\\'; e += c; }
+        else if (uint8_t(c) < 32) { char u[8]; snprintf(u, sizeof(u), "\\u%04x", c); e += u; }
+        else e += c;
+      }
+      return e;
+    }
+    struct Diag { int pos, file, line, col; std::string message, detail; };
+    struct File { int base; std::string name; }; // start and name of an included file, index 0 = the source itself
+    std::vector<Diag> diags;
+    std::unordered_set<int> positions; // of the diags
+    std::vector<std::string> notes;
+    std::string_view src; // needed to map positions to lines
+    std::vector<File> files; // in order of their start
+    LineIndex lines;
+    bool isindexed = false;
+    bool isall; // collect all errors instead of stopping at the first one
+};
+
+// compile-time perfect hash of packed upper-case mnemonics 'ABC' = 0x414243 into 2048 slots
+constexpr uint32_t mneKey(const char* m) { return uint8_t(m[0])<<16 | uint8_t(m[1])<<8 | uint8_t(m[2]); }
+constexpr uint32_t mneHash(uint32_t key) { return (key * 0x277586d3u) >> 21; } // multiplier found by offline search
+
+struct MnemonicTable { uint8_t op[2048]; uint32_t key[256]; bool isperfect; };
+constexpr MnemonicTable makeMnemonicTable()
+{
+  MnemonicTable t{}; t.isperfect = true;
+  bool used[2048]{};
+  for (int h=0; h<2048; h++) t.op[h] = 0xff; // empty slots point to "???" and fail the key check
+  for (int i=0; i<256; i++)
+  {
+    t.key[i] = mneKey(MNEMONICS[i]);
+    uint32_t h = mneHash(t.key[i]);
+    if (used[h]) t.isperfect = false;
+    used[h] = true; t.op[h] = i;
+  }
+  return t;
+}
+constexpr MnemonicTable MNETABLE = makeMnemonicTable();
+static_assert(MNETABLE.isperfect, "mnemonic hash has collisions, choose a different multiplier");
+
+int opCode(std::string_view s, int p, int len) // returns the op code at the specified position and length
+{
+  uint32_t key;
+  if (len == 3) key = mneKey(&s[p]);
+  else if (len == 4 && s[p+2] == '.') key = uint8_t(s[p+3])<<16 | uint8_t(s[p])<<8 | uint8_t(s[p+1]); // AB.C -> CAB
+  else return -1; // can't be an op code
+  key &= ~((key & 0x404040) >> 1); // upper-case: clear bit 5 of all chars with bit 6 set
+  int op = MNETABLE.op[mneHash(key)];
+  return MNETABLE.key[op] == key ? op : -1;
+}
+
+// Byte scanners used by findelem(). Each one returns the first position >= p that matches, or size.
+// The scalar versions are the reference, SSE2 (x86 baseline) and AVX2 (if the CPU supports it)
+// classify 16/32 bytes at a time. Define ASM_SCALAR_SCAN to build without the vector paths.
+int skipSpaceScalar(const char* s, int p, int size, int& line) // first non-separator, counts the skipped LFs
+{
+  for (; p < size && (s[p] <= 32 || s[p] == ','); p++) if (s[p] == '\n') line++;
+  return p;
+}
+int findEOLScalar(const char* s, int p, int size) // first LF
+{
+  while (p < size && s[p] != '\n') p++;
+  return p;
+}
+int findStopScalar(const char* s, int p, int size) // first separator, comment or quotation mark
+{
+  while (p < size && s[p] > 32 && s[p] != ',' && s[p] != ';' && s[p] != '\'' && s[p] != '\"') p++;
+  return p;
+}
+int findQuoteScalar(const char* s, int p, int size, char quote) // first closing quotation mark or control char
+{
+  while (p < size && s[p] != quote && s[p] >= 32) p++;
+  return p;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(ASM_SCALAR_SCAN)
+#define ASM_VECTOR_SCAN
+
+// VEC, LOAD, EQ, LT and MASK describe one vector width, the scanner bodies are the same for SSE2 and AVX2
+#define SCANNERS(W, ATTR)                                                                                      \
+ATTR int skipSpace##W(const char* s, int p, int size, int& line)                                              \
+{                                                                                                              \
+  for (; p + W <= size; p += W)                                                                                \
+  {                                                                                                            \
+    VEC v = LOAD(s + p);                                                                                       \
+    uint32_t sep = MASK(OR(LT(v, 33), EQ(v, ','))), lf = MASK(EQ(v, '\n'));                                    \
+    if (sep != FULL) { int k = __builtin_ctz(~sep); line += __builtin_popcount(lf & ((1u << k) - 1)); return p + k; } \
+    line += __builtin_popcount(lf);                                                                            \
+  }                                                                                                            \
+  return skipSpaceScalar(s, p, size, line);                                                                    \
+}                                                                                                              \
+ATTR int findEOL##W(const char* s, int p, int size)                                                            \
+{                                                                                                              \
+  for (; p + W <= size; p += W)                                                                                \
+    if (uint32_t m = MASK(EQ(LOAD(s + p), '\n'))) return p + __builtin_ctz(m);                                 \
+  return findEOLScalar(s, p, size);                                                                            \
+}                                                                                                              \
+ATTR int findStop##W(const char* s, int p, int size)                                                           \
+{                                                                                                              \
+  for (; p + W <= size; p += W)                                                                                \
+  {                                                                                                            \
+    VEC v = LOAD(s + p);                                                                                       \
+    if (uint32_t m = MASK(OR(OR(LT(v, 33), EQ(v, ',')), OR(OR(EQ(v, ';'), EQ(v, '\'')), EQ(v, '\"')))))       \
+      return p + __builtin_ctz(m);                                                                             \
+  }                                                                                                            \
+  return findStopScalar(s, p, size);                                                                           \
+}                                                                                                              \
+ATTR int findQuote##W(const char* s, int p, int size, char quote)                                              \
+{                                                                                                              \
+  for (; p + W <= size; p += W)                                                                                \
+  {                                                                                                            \
+    VEC v = LOAD(s + p);                                                                                       \
+    if (uint32_t m = MASK(OR(EQ(v, quote), LT(v, 32)))) return p + __builtin_ctz(m);                           \
+  }                                                                                                            \
+  return findQuoteScalar(s, p, size, quote);                                                                   \
+}
+
+#include <immintrin.h>
+#define VEC __m128i
+#define LOAD(a) _mm_loadu_si128((const __m128i*)(a))
+#define EQ(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define LT(v, c) _mm_cmplt_epi8(v, _mm_set1_epi8(c)) // signed, just like 'char' comparisons
+#define OR(a, b) _mm_or_si128(a, b)
+#define MASK(v) uint32_t(_mm_movemask_epi8(v))
+#define FULL 0xffffu
+SCANNERS(16, )
+#undef VEC
+#undef LOAD
+#undef EQ
+#undef LT
+#undef OR
+#undef MASK
+#undef FULL
+#define VEC __m256i
+#define LOAD(a) _mm256_loadu_si256((const __m256i*)(a))
+#define EQ(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define LT(v, c) _mm256_cmpgt_epi8(_mm256_set1_epi8(c), v)
+#define OR(a, b) _mm256_or_si256(a, b)
+#define MASK(v) uint32_t(_mm256_movemask_epi8(v))
+#define FULL 0xffffffffu
+SCANNERS(32, __attribute__((target("avx2"))))
+#undef VEC
+#undef LOAD
+#undef EQ
+#undef LT
+#undef OR
+#undef MASK
+#undef FULL
+#undef SCANNERS
+#endif
+
+struct Scanner // the byte scanners selected for this CPU
+{
+  int (*skipSpace)(const char*, int, int, int&);
+  int (*findEOL)(const char*, int, int);
+  int (*findStop)(const char*, int, int);
+  int (*findQuote)(const char*, int, int, char);
+};
+
+Scanner selectScanner()
+{
+#ifdef ASM_VECTOR_SCAN
+  if (__builtin_cpu_supports("avx2")) return { skipSpace32, findEOL32, findStop32, findQuote32 };
+  return { skipSpace16, findEOL16, findStop16, findQuote16 };
+#else
+  return { skipSpaceScalar, findEOLScalar, findStopScalar, findQuoteScalar };
+#endif
+}
+const Scanner SCAN = selectScanner();
+
+int findelem(std::string_view s, int& ep, int& line) // moves ep to an element and returns its length, 0: valid EOF, -1: error
+{
+  const char* p = s.data();
+  const int size = s.size(); // the source view is not 0-terminated
+  while (true)
+  {
+    ep = SCAN.skipSpace(p, ep, size, line); // handle whitespaces
+    if (ep >= size) return 0; // handle EOF
+    if (p[ep] == ';') // handle ; comments
+    {
+      ep = SCAN.findEOL(p, ep+1, size);
+      if (ep >= size) return 0; // EOF at the end of a comment reached
+      ep++; line++; // consume LF and close comment
+    }
+    else // element start, now calc its length
+    {
+      int n = ep; // from now on, parse with a separate pointer
+      while (true)
+      {
+        n = SCAN.findStop(p, n, size);
+        if (n < size && (p[n] == '\"' || p[n] == '\''))
+        {
+          char quote = p[n++]; // remember quotation style
+          n = SCAN.findQuote(p, n, size, quote);
+          if (n >= size || p[n] != quote) return -1; // EOF \n \r \t = error
+          n++; // consume end quotation
+        }
+        else return n - ep; // element end reached
+      }
+    }
+  }
+}
+
+enum TokenKind : uint8_t { TK_LABEL, TK_DIRECTIVE, TK_STRING, TK_MNEMONIC, TK_NUMBER, TK_EXPR, TK_INVALID, TK_END };
+enum TokenFlag : uint8_t { TF_WORD = 1, TF_LSB = 2, TF_MSB = 4, TF_HEXWORD = 8, TF_RPN = 16 }; // TF_HEXWORD: element is a plain
+                                                                                          // 0x. to 0x...., TF_RPN: see ExprCompiler
+enum Directive : uint8_t { DIR_ORG, DIR_PAGE, DIR_MUTE, DIR_EMIT, DIR_INCLUDE, DIR_ONCE, DIR_IMPORT, DIR_VAR, DIR_ZP, DIR_DATA,
+                          DIR_MACRO, DIR_ENDM, DIR_REP, DIR_ENDR, DIR_BYTES, DIR_WORDS, DIR_ENTRY, DIR_UNKNOWN };
+const char* EXPR_ERRORS[] { "", "Invalid expression.", "Invalid HEX value.", "Empty expression.", "Division by zero.",
+                            "Expression nested too deeply.", "Unknown function.", "Number too large." }; // deferred errors
+
+struct Term // non-constant part of an expression, resolved during pass 2
+{
+  enum : uint8_t { STAR, LABEL, NUM, OP } type; // NUM and OP only in programs (TF_RPN)
+  int sign; // +1 or -1 (NUM: the number, OP: an ExprOp)
+  int pos, len; // label name in the source
+};
+
+struct Token // element of the source, classified and pre-parsed once by Tokenize()
+{
+  int pos, len; // element position and length in the source
+  int line; // line number of the element
+  TokenKind kind;
+  uint8_t flags; // expression flags TF_...
+  uint8_t err; // index into EXPR_ERRORS, reported when the element is used as an expression
+  int value; // op code (TK_MNEMONIC), directive (TK_DIRECTIVE) or sum of all constant expression terms
+  int term, nterms; // non-constant expression terms in TokenStream::terms
+};
+
+struct TokenStream // the whole source as tokens, terminated by TK_END (or TK_INVALID)
+{
+  std::vector<Token> tokens;
+  std::vector<Term> terms;
+};
+
+enum ExprOp : uint8_t { OP_MUL, OP_DIV, OP_MOD, OP_ADD, OP_SUB, OP_SHL, OP_SHR, OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE,
+                       OP_AND, OP_XOR, OP_OR, OP_NEG, OP_NOT, OP_LNOT, OP_SIN, OP_COS, OP_SINW, OP_COSW, OP_SQRT, OP_SQR,
+                       OP_QSQ, OP_ABS };
+constexpr int PRECEDENCE[OP_NEG] { 7, 7, 7, 6, 6, 5, 5, 4, 4, 4, 4, 3, 3, 2, 1, 0 }; // of the binary operators, as in C
+const char* BUILTINS[] { "sin", "cos", "sinw", "cosw", "sqrt", "sqr", "qsq", "abs" }; // OP_SIN.. of one argument
+constexpr int MAXSTACK = 32; // of a program
+
+// Runs the program of a TF_RPN element with * = 'star'. 'label(k, value)' gives the value of the LABEL term k and
+// returns false if it is unknown. Returns 0, -1 (an unknown label) or an index into EXPR_ERRORS.
+// The built-ins take angles in 256ths of a circle: sin/cos return -127..127, sinw/cosw -32767..32767. qsq(x) is x*x/4,
+// the quarter squares of a*b = qsq(a+b)-qsq(a-b). Comparisons are 1 or 0.
+template<class F> int runExpr(const TokenStream& ts, const Token& tok, int star, F label, int& value)
+{
+  int64_t stack[MAXSTACK]; int n = 0;
+  for (int k=tok.term; k<tok.term+tok.nterms; k++)
+  {
+    const Term& term = ts.terms[k];
+    if (term.type == Term::NUM) stack[n++] = term.sign;
+    else if (term.type == Term::STAR) stack[n++] = star;
+    else if (term.type == Term::LABEL) { int v; if (!label(k, v)) return -1; stack[n++] = v; }
+    else if (term.sign >= OP_NEG) // unary
+    {
+      int64_t& a = stack[n-1];
+      constexpr double TURN = 6.283185307179586 / 256;
+      switch (term.sign)
+      {
+        case OP_NEG: a = -a; break;
+        case OP_NOT: a = ~a; break;
+        case OP_LNOT: a = !a; break;
+        case OP_SIN: a = std::lround(127 * std::sin(TURN * a)); break;
+        case OP_COS: a = std::lround(127 * std::cos(TURN * a)); break;
+        case OP_SINW: a = std::lround(32767 * std::sin(TURN * a)); break;
+        case OP_COSW: a = std::lround(32767 * std::cos(TURN * a)); break;
+        case OP_SQRT: a = a <= 0 ? 0 : int64_t(std::sqrt(double(a))); break;
+        case OP_SQR: a = a * a; break;
+        case OP_QSQ: a = a * a / 4; break;
+        case OP_ABS: a = a < 0 ? -a : a; break;
+      }
+    }
+    else // binary
+    {
+      int64_t b = stack[--n], &a = stack[n-1];
+      switch (term.sign)
+      {
+        case OP_MUL: a *= b; break;
+        case OP_DIV: if (b == 0) return 4; a /= b; break;
+        case OP_MOD: if (b == 0) return 4; a %= b; break;
+        case OP_ADD: a += b; break;
+        case OP_SUB: a -= b; break;
+        case OP_SHL: a = b < 0 || b > 31 ? 0 : int32_t(uint32_t(a) << b); break;
+        case OP_SHR: a = b < 0 || b > 31 ? (a < 0 ? -1 : 0) : a >> b; break;
+        case OP_LT: a = a < b; break;
+        case OP_LE: a = a <= b; break;
+        case OP_GT: a = a > b; break;
+        case OP_GE: a = a >= b; break;
+        case OP_EQ: a = a == b; break;
+        case OP_NE: a = a != b; break;
+        case OP_AND: a &= b; break;
+        case OP_XOR: a ^= b; break;
+        case OP_OR: a |= b; break;
+      }
+    }
+    stack[n-1] = int32_t(uint32_t(stack[n-1])); // wraps around like the sums
+  }
+  value = int(stack[0]);
+  return 0;
+}
+
+// Reads the digits of a HEX or decimal number from x on into 'value', returns their end or -1 if the number doesn't
+// fit 32 bits (HEX: up to 0xffffffff, decimal: up to 2147483647)
+int readNumber(std::string_view src, int x, int end, bool ishex, int& value)
+{
+  uint32_t v = 0;
+  for (; x < end; x++)
+  {
+    char c = src[x];
+    int d = c >= '0' && c <= '9' ? c - '0' : ishex && isxdigit(uint8_t(c)) ? (c | 0x20) - 'a' + 10 : -1;
+    if (d < 0) break;
+    if (v > (ishex ? 0x0fffffffu : (0x7fffffffu - d) / 10)) return -1;
+    v = ishex ? v << 4 | d : v * 10 + d;
+  }
+  value = int32_t(v);
+  return x;
+}
+
+// End of the label (or mnemonic) at k: stops at one of 'stops', but the suffix ~id of a local label of an expansion
+// (Preprocessor::generate) belongs to it, a '~' can't follow an operand since it is unary
+int labelEnd(std::string_view src, int k, int end, const char* stops)
+{
+  for (;;)
+  {
+    while (k < end && !strchr(stops, src[k])) k++;
+    if (k+1 < end && src[k] == '~' && src[k+1] >= '0' && src[k+1] <= '9') k++; else return k;
+  }
+}
+
+// Compiles an element that is more than a sum into a program of terms in reverse polish notation: the binary operators
+// of C (* / % + - << >> < <= > >= == != & ^ |) by precedence, unary - ~ !, parentheses, the built-ins of BUILTINS and
+// all operands of sums. A constant program is run right away (a TK_NUMBER), only those with labels or * are left for
+// pass 2 (TF_RPN). Like labels and *, they are words unless a <|> prefix takes a byte of them.
+class ExprCompiler
+{
+  public:
+    ExprCompiler(std::string_view source, Token& token, TokenStream& stream) : src(source), tok(token), ts(stream) {}
+    void Compile()
+    {
+      x = tok.pos; end = tok.pos + tok.len;
+      tok.value = 0; tok.flags = 0; tok.err = 0; ts.terms.resize(tok.term);
+      if (at(x) == '<' || at(x) == '>') tok.flags |= src[x++] == '<' ? TF_LSB : TF_MSB;
+      if (!binary(0) || x != end) { if (tok.err == 0) tok.err = 1; }
+      else if (high > MAXSTACK) tok.err = 5;
+      else if (iswide) tok.flags |= TF_WORD | TF_RPN;
+      else // constant
+      {
+        tok.nterms = ts.terms.size() - tok.term;
+        int value, err = runExpr(ts, tok, 0, [](int, int&) { return false; }, value);
+        if (err > 0) tok.err = err;
+        else { tok.value = value; if (value > 255 || value < -128) tok.flags |= TF_WORD; }
+        ts.terms.resize(tok.term);
+      }
+      if (tok.err) ts.terms.resize(tok.term);
+      tok.nterms = ts.terms.size() - tok.term;
+    }
+  protected:
+    char at(int i) const { return i < end ? src[i] : 0; }
+    void push(decltype(Term::type) type, int sign, int pos, int len)
+      { ts.terms.push_back({ type, sign, pos, len }); depth += type == Term::OP ? (sign < OP_NEG ? -1 : 0) : 1; high = std::max(high, depth); }
+    int binop(int& len) const // the binary operator at x or -1
+    {
+      char c = at(x), d = at(x+1);
+      len = 1;
+      switch (c)
+      {
+        case '*': return OP_MUL;
+        case '/': return OP_DIV;
+        case '%': return OP_MOD;
+        case '+': return OP_ADD;
+        case '-': return OP_SUB;
+        case '&': return OP_AND;
+        case '^': return OP_XOR;
+        case '|': return OP_OR;
+        case '<': if (d == '<' || d == '=') len = 2; return d == '<' ? OP_SHL : d == '=' ? OP_LE : OP_LT;
+        case '>': if (d == '>' || d == '=') len = 2; return d == '>' ? OP_SHR : d == '=' ? OP_GE : OP_GT;
+        case '=': len = 2; return d == '=' ? OP_EQ : -1;
+        case '!': len = 2; return d == '=' ? OP_NE : -1;
+      }
+      return -1;
+    }
+    bool binary(int level) // the operators of this precedence level and above
+    {
+      if (level > 7) return unary();
+      if (!binary(level + 1)) return false;
+      for (int op, len; (op = binop(len)) != -1 && PRECEDENCE[op] == level;)
+      {
+        int pos = x; x += len;
+        if (!binary(level + 1)) return false;
+        push(Term::OP, op, pos, len);
+      }
+      return true;
+    }
+    bool unary()
+    {
+      if (++nesting > MAXSTACK) { tok.err = 5; return false; } // also bounds the recursion
+      bool isok = operand();
+      nesting--;
+      return isok;
+    }
+    bool operand()
+    {
+      int pos = x;
+      char c = at(x);
+      if (c == '-' || c == '+' || c == '~' || c == '!')
+      {
+        x++;
+        if (!unary()) return false;
+        if (c != '+') push(Term::OP, c == '-' ? OP_NEG : c == '~' ? OP_NOT : OP_LNOT, pos, 1);
+        return true;
+      }
+      if (c == '(')
+      {
+        x++;
+        if (!binary(0) || at(x) != ')') return false;
+        x++; return true;
+      }
+      if (c == '\'' || c == '\"') // single characters '.' or "."
+      {
+        if (x+2 >= end || src[x+2] != c) return false;
+        push(Term::NUM, uint8_t(src[x+1]), pos, 3); x += 3; return true;
+      }
+      if (c == '0' && at(x+1) == 'x') // hex number
+      {
+        int value, k = readNumber(src, x+2, end, true, value);
+        if (k == -1) { tok.err = 7; return false; }
+        if (k == x+2) { tok.err = 2; return false; }
+        if (k > x+4) tok.flags |= TF_WORD;
+        push(Term::NUM, value, pos, k - x); x = k; return true;
+      }
+      if (c >= '0' && c <= '9') // decimal number
+      {
+        int value, k = readNumber(src, x, end, false, value);
+        if (k == -1) { tok.err = 7; return false; }
+        push(Term::NUM, value, pos, k - pos); x = k; return true;
+      }
+      if (c == '*') { push(Term::STAR, 1, pos, 1); iswide = true; x++; return true; } // * = emission pointer
+      int k = labelEnd(src, x, end, " +-\n\r\t,;*/%&|^()<>=!~\'\""); // a label, a mnemonic or a built-in
+      if (k == x) return false;
+      std::string_view name = src.substr(x, k-x);
+      x = k;
+      if (at(x) == '(') // built-in
+      {
+        auto f = std::find(std::begin(BUILTINS), std::end(BUILTINS), name);
+        if (f == std::end(BUILTINS)) { tok.err = 6; return false; }
+        if (!unary()) return false;
+        push(Term::OP, OP_SIN + (f - std::begin(BUILTINS)), pos, k - pos); return true;
+      }
+      int op = opCode(src, pos, k - pos);
+      if (op != -1) push(Term::NUM, op, pos, k - pos); // op code
+      else { push(Term::LABEL, 1, pos, k - pos); iswide = true; }
+      return true;
+    }
+    std::string_view src;
+    Token& tok;
+    TokenStream& ts;
+    int x = 0, end = 0; // parsed up to x
+    int depth = 0, high = 0, nesting = 0; // of the stack, of unary operators and parentheses
+    bool iswide = false; // labels or *
+};
+
+// Splits an expression element into its terms: <|> prefix, +/- terms of numbers, 'c', *, mnemonics and labels.
+// Constant terms are summed up in tok.value, labels and * are stored as terms for pass 2.
+void splitExpr(std::string_view src, Token& tok, TokenStream& ts)
+{
+  int x = tok.pos, end = tok.pos + tok.len;
+  auto at = [&](int i) { return i < end ? src[i] : 0; }; // never reads beyond the element
+  tok.value = 0; tok.term = ts.terms.size();
+
+  if (at(x) == '<' || at(x) == '>') // extract a leading MSB/LSB operator
+  {
+    if (src[x++] == '<') tok.flags |= TF_LSB; else tok.flags |= TF_MSB;
+  }
+
+  do
+  {
+    int term = 0, sign = 1;
+
+    if (at(x) == '+') { sign = 1; x++; } // take leading sign, reset term
+    else if (at(x) == '-') { sign = -1; x++; }
+
+    if (at(x) == '\'' || at(x) == '\"') // single characters '.' or "."
+    {
+      if (tok.len >= 3 && at(x+2) == src[x]) { term = src[x+1]; x += 3; }
+      else { tok.err = 1; break; }
+    }
+    else if (at(x) == '0' && at(x+1) == 'x') // hex number
+    {
+      int k = readNumber(src, x+2, end, true, term);
+      if (k == -1) { tok.err = 7; break; }
+      if (k == x+2) { tok.err = 2; break; }
+      if (k > x+4) tok.flags |= TF_WORD;
+      if (x == tok.pos && k == end && tok.len <= 6) tok.flags |= TF_HEXWORD;
+      x = k;
+    }
+    else if (at(x) == '*') { ts.terms.push_back({ Term::STAR, sign, x, 1 }); tok.flags |= TF_WORD; x++; continue; } // * = emission pointer
+    else if (at(x) >= '0' && at(x) <= '9') // decimal number
+    {
+      if ((x = readNumber(src, x, end, false, term)) == -1) { tok.err = 7; break; }
+      if (sign*term > 255 || sign*term < -128) tok.flags |= TF_WORD; // user chose word deliberately
+    }
+    else // must be a label ref or embedded mnemonic
+    {
+      int k = labelEnd(src, x, end, " +-\n\r\t,;*/%&|^()<>=!~"); // find end of label ref
+      if (k == x) { if (x < end && strchr("*/%&|^()<>=!~", src[x])) { ExprCompiler(src, tok, ts).Compile(); return; } tok.err = 3; break; }
+      if ((term = opCode(src, x, k-x)) == -1) // op code as part of an expression? ... or label ref?
+      {
+        tok.flags |= TF_WORD;
+        ts.terms.push_back({ Term::LABEL, sign, x, k-x });
+        term = 0;
+      }
+      x = k; // consume this element part
+    }
+    tok.value += sign * term; // add this constant term to the expression
+  } while (x < end && (src[x] == '+' || src[x] == '-'));
+
+  if (tok.err == 0 && x != end && strchr("*/%&|^()<>=!~", src[x])) { ExprCompiler(src, tok, ts).Compile(); return; } // more than a sum
+  if (tok.err == 0 && x != end) tok.err = 1;
+  tok.nterms = ts.terms.size() - tok.term;
+}
+
+// Lexes and classifies the whole source once, or its lines from position 'ep' (in 'line') on without the final TK_END
+void Tokenize(std::string_view src, TokenStream& ts, int ep = 0, int line = 1, bool iswhole = true)
+{
+  if (iswhole) { ts.tokens.reserve(src.size() / 8 + 1); ts.terms.reserve(src.size() / 32 + 1); } // typical densities
+  int elen;
+  while ((elen = findelem(src, ep, line)) != 0) // any element to process?
+  {
+    if (elen == -1) // invalid element: mark it and resume in the next line
+    {
+      ts.tokens.push_back({ ep, 0, line, TK_INVALID, 0, 0, 0, 0, 0 });
+      if ((ep = SCAN.findEOL(src.data(), ep, src.size())) < int(src.size())) { ep++; line++; }
+      continue;
+    }
+    Token tok{ ep, elen, line, TK_EXPR, 0, 0, 0, 0, 0 };
+    if (src[ep+elen-1] == ':') tok.kind = TK_LABEL; // label definition
+    else if (src[ep] == '#') // preprocessor command
+    {
+      tok.kind = TK_DIRECTIVE; tok.value = DIR_UNKNOWN;
+      if (elen == 4 && src.substr(ep+1, 3) == "org") tok.value = DIR_ORG;
+      else if (elen == 5 && src.substr(ep+1, 4) == "page") tok.value = DIR_PAGE;
+      else if (elen == 5 && src.substr(ep+1, 4) == "mute") tok.value = DIR_MUTE;
+      else if (elen == 5 && src.substr(ep+1, 4) == "emit") tok.value = DIR_EMIT;
+      else if (elen == 8 && src.substr(ep+1, 7) == "include") tok.value = DIR_INCLUDE;
+      else if (elen == 5 && src.substr(ep+1, 4) == "once") tok.value = DIR_ONCE;
+      else if (elen == 7 && src.substr(ep+1, 6) == "import") tok.value = DIR_IMPORT;
+      else if (elen == 4 && src.substr(ep+1, 3) == "var") tok.value = DIR_VAR;
+      else if (elen == 3 && src.substr(ep+1, 2) == "zp") tok.value = DIR_ZP;
+      else if (elen == 5 && src.substr(ep+1, 4) == "data") tok.value = DIR_DATA;
+      else if (elen == 6 && src.substr(ep+1, 5) == "macro") tok.value = DIR_MACRO;
+      else if (elen == 5 && src.substr(ep+1, 4) == "endm") tok.value = DIR_ENDM;
+      else if (elen == 4 && src.substr(ep+1, 3) == "rep") tok.value = DIR_REP;
+      else if (elen == 5 && src.substr(ep+1, 4) == "endr") tok.value = DIR_ENDR;
+      else if (elen == 6 && src.substr(ep+1, 5) == "bytes") tok.value = DIR_BYTES;
+      else if (elen == 6 && src.substr(ep+1, 5) == "words") tok.value = DIR_WORDS;
+      else if (elen == 6 && src.substr(ep+1, 5) == "entry") tok.value = DIR_ENTRY;
+    }
+    else if ((tok.value = opCode(src, ep, elen)) != -1) tok.kind = TK_MNEMONIC;
+    else // strings and expressions
+    {
+      splitExpr(src, tok, ts);
+      if ((src[ep] == '\'' || src[ep] == '\"') && src[ep+elen-1] == src[ep]) tok.kind = TK_STRING; // pure string
+      else if (tok.nterms == 0) tok.kind = TK_NUMBER;
+    }
+    ts.tokens.push_back(tok);
+    ep += elen; // consume processed element
+  }
+  if (iswhole) ts.tokens.push_back({ ep, 0, line, TK_END, 0, 0, 0, 0, 0 });
+}
+
+// Brings the tokens of 'text' up to date with its new version 'src': Elements never span lines, so only the lines from
+// the first to the last changed character are lexed again, the tokens behind them are just moved.
+void Relex(std::string& text, std::string_view src, TokenStream& ts, TokenStream& scratch)
+{
+  std::string_view old = text;
+  size_t n = std::min(old.size(), src.size()), p = 0, q = 0;
+  while (p < n && old[p] == src[p]) p++; // common head
+  while (q < n - p && old[old.size()-1-q] == src[src.size()-1-q]) q++; // common tail
+  if (p == old.size() && p == src.size()) return; // unchanged
+  size_t from = p == 0 ? 0 : old.rfind('\n', p-1) + 1; // start of the first changed line
+  size_t oldend = old.find('\n', old.size() - q); // end of the last changed line
+  if (oldend == std::string_view::npos) oldend = old.size();
+  size_t newend = oldend + src.size() - old.size();
+  int line = 1 + std::count(old.begin(), old.begin() + from, '\n');
+  int lines = std::count(src.begin() + from, src.begin() + newend, '\n') - std::count(old.begin() + from, old.begin() + oldend, '\n');
+  int shift = src.size() - old.size();
+
+  auto first = [&ts](size_t pos) // index of the first token at or behind 'pos'
+    { return std::lower_bound(ts.tokens.begin(), ts.tokens.end(), pos, [](const Token& t, size_t p) { return size_t(t.pos) < p; }) - ts.tokens.begin(); };
+  int a = first(from), b = first(oldend);
+  text.assign(src);
+  scratch.tokens.clear(); scratch.terms.clear();
+  Tokenize(std::string_view(text).substr(0, newend), scratch, from, line, false);
+  for (size_t t=b; t<ts.tokens.size(); t++) // move the tokens behind the change
+  {
+    Token& tok = ts.tokens[t];
+    tok.pos += shift; tok.line += lines;
+    for (int i=0; i<tok.nterms; i++) ts.terms[tok.term + i].pos += shift;
+  }
+  for (Token& tok : scratch.tokens) tok.term += ts.terms.size();
+  ts.terms.insert(ts.terms.end(), scratch.terms.begin(), scratch.terms.end()); // the terms of replaced tokens are left over
+  ts.tokens.erase(ts.tokens.begin() + a, ts.tokens.begin() + b);
+  ts.tokens.insert(ts.tokens.begin() + a, scratch.tokens.begin(), scratch.tokens.end());
+  if (ts.terms.size() > 2 * ts.tokens.size() + 4096) // too many left over: compact the terms
+  {
+    scratch.terms.clear();
+    for (Token& tok : ts.tokens)
+    {
+      scratch.terms.insert(scratch.terms.end(), ts.terms.begin() + tok.term, ts.terms.begin() + tok.term + tok.nterms);
+      tok.term = scratch.terms.size() - tok.nterms;
+    }
+    std::swap(ts.terms, scratch.terms);
+  }
+}
+
+class SourceFile // read-only view of a source file, memory-mapped where available
+{
+  public:
+    SourceFile(const char* filename)
+    {
+#ifndef _WIN32
+      int fd = open(filename, O_RDONLY);
+      if (fd == -1) return;
+      struct stat st;
+      if (fstat(fd, &st) == 0)
+      {
+        isopen = true; size = st.st_size;
+        if (size > 0) data = (const char*)mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { data = nullptr; isopen = false; }
+        else if (data) madvise((void*)data, size, MADV_SEQUENTIAL);
+      }
+      close(fd);
+#else
+      std::ifstream file(filename, std::ios::binary);
+      if (file.is_open())
+      {
+        isopen = true; buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        data = buffer.data(); size = buffer.size();
+      }
+#endif
+    }
+    ~SourceFile()
+    {
+#ifndef _WIN32
+      if (data) munmap((void*)data, size);
+#endif
+    }
+    bool IsOpen() const { return isopen; }
+    std::string_view Data() const { return std::string_view(data, size); } // the whole file
+    std::string_view Text() const // the source ends at the first 0 byte, just like the native assembler
+    {
+      std::string_view text(data, size);
+      return text.substr(0, text.find('\0'));
+    }
+  protected:
+    bool isopen = false;
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    std::string buffer;
+#endif
+};
+
+class Hash128 // fast 128-bit content hash of two multiply-xorshift lanes (not cryptographic)
+{
+  public:
+    Hash128& Add(const void* data, size_t size) // the size is hashed, too: no ambiguous concatenations
+    {
+      const uint8_t* p = (const uint8_t*)data;
+      mix(size);
+      for (; size >= 8; p += 8, size -= 8) { uint64_t w; memcpy(&w, p, 8); mix(w); }
+      if (size > 0) { uint64_t w = 0; memcpy(&w, p, size); mix(w); }
+      return *this;
+    }
+    Hash128& Add(std::string_view s) { return Add(s.data(), s.size()); }
+    std::string Hex() const // 32 lower-case HEX digits
+    {
+      std::string h;
+      for (uint64_t v : { fmix(a ^ b), fmix(b + (a << 1)) })
+        for (int i=7; i>=0; i--) h.append(HEXTABLE.lower[(v >> (8*i)) & 0xff], 2);
+      return h;
+    }
+  protected:
+    void mix(uint64_t w)
+    {
+      a = (a ^ w) * 0x9e3779b97f4a7c15ull; a ^= a >> 32;
+      b = (b + w + (a >> 7)) * 0xff51afd7ed558ccdull; b ^= b >> 29;
+    }
+    static uint64_t fmix(uint64_t v) { v ^= v >> 33; v *= 0xc4ceb9fe1a85ec53ull; return v ^ (v >> 33); }
+    uint64_t a = 0x243f6a8885a308d3ull, b = 0x13198a2e03707344ull;
+};
+
+std::string hashFile(const std::string& path) // content hash of a file, "" if it can't be read
+{
+  SourceFile file(path.c_str());
+  return file.IsOpen() ? Hash128().Add(file.Data()).Hex() : "";
+}
+
+std::string hashISA() { return Hash128().Add(MNEMONICS, sizeof(MNEMONICS)).Add(ARGS.data(), ARGS.size() * sizeof(int)).Hex(); }
+
+// Binary symbol file (little-endian), used in place of its memory-mapped file: a header, the entries sorted by name,
+// the names and the "<hash> <path>" lines of the sources it was made of. Each entry holds the FNV-1a hash of its name.
+class SymbolFile
+{
+  public:
+    struct Entry { uint32_t hash, name; uint16_t len, value; }; // name: offset in the names
+    static std::string Write(const SymbolTable& symbols, const std::vector<std::string>& sources)
+    {
+      std::vector<int> order;
+      for (int k=0; k<symbols.Size(); k++) if (!symbols.IsPoisoned(k)) order.push_back(k);
+      std::sort(order.begin(), order.end(), [&](int a, int b) { return symbols.Name(a) < symbols.Name(b); });
+      std::string entries, names, deps;
+      for (int k : order)
+      {
+        Entry e { SymbolTable::Hash(symbols.Name(k)), uint32_t(names.size()), uint16_t(symbols.Name(k).size()), uint16_t(symbols.Value(k)) };
+        entries.append((const char*)&e, sizeof(e)); names += symbols.Name(k);
+      }
+      for (const std::string& path : sources) if (std::string hash = hashFile(path); !hash.empty()) deps += hash + " " + path + "\n";
+      std::string payload = entries + names + deps;
+      uint32_t sizes[4] { uint32_t(order.size()), uint32_t(names.size()), uint32_t(deps.size()), 0 };
+      return MAGIC + hashISA() + Hash128().Add(payload).Hex() + std::string((const char*)sizes, sizeof(sizes)) + payload;
+    }
+    std::string Load(std::string_view file) // returns an error message, "": the symbols can be used
+    {
+      uint32_t sizes[4];
+      if (file.size() < HEADER || file.substr(0, 8) != MAGIC) return "is not a symbol file";
+      if (file.substr(8, 32) != hashISA()) return "was made for another instruction set";
+      memcpy(sizes, file.data() + 72, sizeof(sizes));
+      if (HEADER + size_t(sizes[0]) * sizeof(Entry) + sizes[1] + sizes[2] != file.size()
+        || file.substr(40, 32) != Hash128().Add(file.substr(HEADER)).Hex()) return "is damaged";
+      first = (const Entry*)(file.data() + HEADER); last = first + sizes[0];
+      names = file.substr(HEADER + sizes[0] * sizeof(Entry), sizes[1]);
+      for (const Entry* e = first; e < last; e++) if (size_t(e->name) + e->len > names.size()) return "is damaged";
+      std::string_view deps = file.substr(file.size() - sizes[2]);
+      for (size_t a = 0, e; a < deps.size(); a = e + 1) // sources that are gone can't be checked
+      {
+        e = deps.find('\n', a);
+        std::string_view dep = deps.substr(a, e - a);
+        std::string path(dep.substr(std::min<size_t>(33, dep.size()))), hash = hashFile(path);
+        if (!hash.empty() && hash != dep.substr(0, 32)) return "is out of date, '" + path + "' has changed";
+      }
+      return "";
+    }
+    std::pair<const Entry*, const Entry*> Prefix(std::string_view tag) const // all entries starting with 'tag'
+    {
+      const Entry* a = std::lower_bound(first, last, tag, [&](const Entry& e, std::string_view t) { return Name(e) < t; });
+      const Entry* b = a;
+      while (b < last && Name(*b).substr(0, tag.size()) == tag) b++;
+      return { a, b };
+    }
+    std::string_view Name(const Entry& e) const { return names.substr(e.name, e.len); }
+  protected:
+    static constexpr size_t HEADER = 88; // magic, ISA hash, payload hash, 4 sizes
+    inline static const std::string MAGIC = "MINASMS1";
+    const Entry* first = nullptr;
+    const Entry* last = nullptr;
+    std::string_view names;
+};
+
+class IncludeCache // included and imported files, each one is read and prepared once per process and shared by all assemblies
+{
+  public:
+    struct File
+    {
+      File(const std::string& path, std::string stamp) : source(path.c_str()), stamp(std::move(stamp)) {}
+      SourceFile source;
+      std::string stamp; // time and size of the file when it was read
+      TokenStream ts; // positions relative to the file
+      bool isonce = false; // the file contains '#once'
+      SymbolFile symbols;
+      std::string error; // why the symbol file can't be imported
+      std::once_flag tokenized, loaded;
+    };
+    // A file that changed on disk is read again, assemblies still using the previous version keep it.
+    std::shared_ptr<File> Get(const std::string& path) // an included source, thread-safe, 'path' is canonical
+    {
+      std::shared_ptr<File> shared = find(path);
+      File& file = *shared;
+      std::call_once(file.tokenized, [&file] // other files are looked up meanwhile
+      {
+        if (!file.source.IsOpen()) return;
+        Tokenize(file.source.Text(), file.ts);
+        for (const Token& tok : file.ts.tokens) if (tok.kind == TK_DIRECTIVE && tok.value == DIR_ONCE) file.isonce = true;
+      });
+      return shared;
+    }
+    std::shared_ptr<File> Symbols(const std::string& path) // an imported symbol file, check File::error
+    {
+      std::shared_ptr<File> shared = find(path);
+      File& file = *shared;
+      std::call_once(file.loaded, [&file] { file.error = file.source.IsOpen() ? file.symbols.Load(file.source.Data()) : "can't be opened"; });
+      return shared;
+    }
+  protected:
+    std::shared_ptr<File> find(const std::string& path)
+    {
+      std::error_code ec, ec2; // a missing file has no stamp
+      std::string stamp = std::to_string(std::filesystem::last_write_time(path, ec).time_since_epoch().count()) + " "
+                        + std::to_string(std::filesystem::file_size(path, ec2));
+      std::lock_guard<std::mutex> guard(lock);
+      std::shared_ptr<File>& slot = files[path];
+      if (!slot || slot->stamp != stamp) slot = std::make_shared<File>(path, stamp);
+      return slot;
+    }
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<File>> files;
+};
+IncludeCache INCLUDES;
+
+// Replaces each '#include "file"' by the tokens of that file, recursively. The text of every included file is appended
+// to the source once and the positions of its tokens are moved there, so both passes work on one source as before.
+// '#import "file" ["tag"]' loads a symbol file, pass 1 defines its symbols [starting with tag] at the '#import'.
+// '#macro name [params]' .. '#endm' defines a macro, 'name [args]' in a later line expands it. '#rep n [counter]' ..
+// '#endr' repeats its lines n times with the counter 0..n-1. Every expansion is appended to the source as text (the
+// arguments and the counter replace their names, labels starting with '.' get a suffix of their own) and is lexed as
+// a file of its own, named e.g. "copy at line 12": errors inside show its line counted from the '#macro' line.
+class Preprocessor
+{
+  public:
+    struct Import { const SymbolFile* symbols; std::string tag; }; // referenced by Token::term of DIR_IMPORT
+    Preprocessor(std::string_view source, std::string_view path, Diagnostics& diagnostics, bool listing = false)
+      : text(source), dir(std::filesystem::path(path).parent_path()), diag(diagnostics), islisting(listing)
+    {
+      std::error_code ec; // the source itself can't be included either
+      if (!path.empty()) stack.push_back(std::filesystem::weakly_canonical(std::filesystem::path(path), ec).string());
+    }
+    bool Expand(const TokenStream& in, TokenStream& out) // false: abort after an error
+    {
+      out.tokens.reserve(in.tokens.size()); out.terms.reserve(in.terms.size());
+      if (!expand(in, 0, dir, "", out)) return false;
+      out.tokens.push_back(in.tokens.back()); // TK_END of the main source
+      return true;
+    }
+    std::string_view Text() const { return text; } // the source followed by all included files
+    const std::vector<std::string>& Files() const { return paths; } // canonical paths of the included and imported files
+    const Import& GetImport(const Token& tok) const { return imports[tok.term]; }
+  protected:
+    struct Macro { std::string text; std::vector<Token> tokens; std::vector<Term> terms; std::vector<std::string> params; }; // or '#rep'
+    bool fail(const Token& tok, std::string msg) { diag.Error(tok.pos, std::move(msg)); return diag.Stop(); }
+    bool expand(const TokenStream& in, int base, const std::filesystem::path& from, const std::string& file, TokenStream& out)
+    {
+      int first = out.terms.size();
+      for (Term term : in.terms) { term.pos += base; out.terms.push_back(term); }
+      for (size_t t=0; t+1<in.tokens.size(); t++) // all but TK_END
+      {
+        Token tok = in.tokens[t]; tok.pos += base; tok.term += first;
+        if (tok.kind == TK_DIRECTIVE && tok.value >= DIR_MACRO && tok.value <= DIR_ENDR)
+        {
+          if (tok.value == DIR_ENDM || tok.value == DIR_ENDR)
+            { if (fail(tok, tok.value == DIR_ENDM ? "\'#endm\' without \'#macro\'." : "\'#endr\' without \'#rep\'.")) return false; continue; }
+          std::string at = " at line " + std::to_string(tok.line) + (file.empty() ? "" : " of " + file);
+          if (!block(in, base, t, from, at, out)) return false;
+          continue;
+        }
+        if (tok.kind == TK_EXPR && !macros.empty() && isName(in, t)) // a macro?
+        {
+          auto it = macros.find(std::string(text.substr(tok.pos, tok.len)));
+          if (it != macros.end())
+          {
+            const Macro& macro = it->second;
+            std::vector<std::string> args;
+            for (size_t a=t+1; a+1<in.tokens.size() && in.tokens[a].line == in.tokens[t].line; a++)
+              args.emplace_back(text.substr(base + in.tokens[a].pos, in.tokens[a].len));
+            t += args.size();
+            if (args.size() != macro.params.size())
+              { if (fail(tok, "Macro \'" + it->first + "\' expects " + std::to_string(macro.params.size()) + (macro.params.size() == 1 ? " argument." : " arguments."))) return false; continue; }
+            std::string name = it->first + " at line " + std::to_string(tok.line) + (file.empty() ? "" : " of " + file);
+            if (!instantiate(tok, macro, args, name, from, out)) return false;
+            continue;
+          }
+        }
+        bool isimport = tok.kind == TK_DIRECTIVE && tok.value == DIR_IMPORT;
+        if (tok.kind != TK_DIRECTIVE || (tok.value != DIR_INCLUDE && !isimport)) { if (tok.kind != TK_DIRECTIVE || tok.value != DIR_ONCE) out.tokens.push_back(tok); continue; }
+        Token arg = in.tokens[t+1]; arg.pos += base;
+        if (arg.kind != TK_STRING || arg.len < 3) { if (fail(tok, "Expecting a file name in quotes.")) return false; continue; }
+        t++; // consume the file name
+        std::filesystem::path name = (from / text.substr(arg.pos+1, arg.len-2)).lexically_normal();
+        std::error_code ec;
+        std::string path = std::filesystem::weakly_canonical(name, ec).string();
+        if (ec) path = name.string();
+        if (isimport)
+        {
+          const Token& tag = in.tokens[t+1]; // an optional "tag" in the same line
+          tok.term = imports.size(); imports.push_back({ nullptr, "" });
+          if (tag.kind == TK_STRING && tag.line == in.tokens[t].line) { imports.back().tag = text.substr(base+tag.pos+1, tag.len-2); t++; }
+          const IncludeCache::File& file = *held.emplace_back(INCLUDES.Symbols(path));
+          if (!file.error.empty()) { if (fail(arg, "Symbol file \'" + name.string() + "\' " + file.error + ".")) return false; continue; }
+          if (std::find(paths.begin(), paths.end(), path) == paths.end()) paths.push_back(path);
+          imports.back().symbols = &file.symbols;
+          out.tokens.push_back(tok);
+          continue;
+        }
+        if (onces.count(path)) continue; // guarded by '#once'
+        if (std::find(stack.begin(), stack.end(), path) != stack.end()) { if (fail(arg, "Recursive include.")) return false; continue; }
+        const IncludeCache::File& file = *held.emplace_back(INCLUDES.Get(path));
+        if (!file.source.IsOpen()) { if (fail(arg, "Can't open include file \'" + name.string() + "\'.")) return false; continue; }
+        if (file.isonce) onces.insert(path);
+        auto [at, isnew] = bases.insert({ path, 0 });
+        if (isnew) // first inclusion: the file starts on a line of its own
+        {
+          if (text.back() != '\n') text += '\n';
+          at->second = text.size(); text += file.source.Text();
+          diag.Include(text, at->second, name.string());
+          paths.push_back(path);
+        }
+        stack.push_back(path);
+        bool isok = expand(file.ts, at->second, name.parent_path(), name.string(), out);
+        stack.pop_back();
+        if (!isok) return false;
+      }
+      return true;
+    }
+    // An element that is nothing but a name
+    static bool isName(const TokenStream& in, size_t t)
+    {
+      const Token& tok = in.tokens[t];
+      if (tok.kind != TK_EXPR || tok.nterms != 1 || tok.value != 0 || (tok.flags & (TF_LSB | TF_MSB))) return false;
+      const Term& term = in.terms[tok.term];
+      return term.type == Term::LABEL && term.pos == tok.pos && term.len == tok.len;
+    }
+    // '#macro name [params]' or '#rep n [counter]' at t: keeps the macro or expands the repetitions, t: its end
+    bool block(const TokenStream& in, int base, size_t& t, const std::filesystem::path& from, const std::string& at, TokenStream& out)
+    {
+      const Token& head = in.tokens[t];
+      bool ismacro = head.value == DIR_MACRO;
+      Token tok = head; tok.pos += base;
+      size_t h = t + 1; // the rest of the line names the macro and its parameters, or the count and the counter
+      int count = 1;
+      if (!ismacro)
+      {
+        const Token& n = in.tokens[h];
+        if (h+1 < in.tokens.size() && n.line == head.line && n.kind == TK_NUMBER && n.value >= 0 && n.value <= 0x10000) { count = n.value; h++; }
+        else return !fail(tok, "Expecting a repeat count.");
+      }
+      else if (h+1 == in.tokens.size() || in.tokens[h].line != head.line || !isName(in, h)) return !fail(tok, "Expecting a macro name.");
+      Macro body;
+      for (; h+1 < in.tokens.size() && in.tokens[h].line == head.line; h++)
+      {
+        if (!isName(in, h)) return !fail(tok, ismacro ? "Expecting a parameter name." : "Expecting a counter name.");
+        body.params.emplace_back(text.substr(base + in.tokens[h].pos, in.tokens[h].len));
+      }
+      if (!ismacro && body.params.size() > 1) return !fail(tok, "Expecting a counter name.");
+      std::string name = ismacro ? body.params.front() : "";
+      if (ismacro) body.params.erase(body.params.begin());
+      size_t end = h;
+      for (int depth = 1; end+1 < in.tokens.size(); end++) // the matching '#endm' or '#endr'
+      {
+        const Token& e = in.tokens[end];
+        if (e.kind != TK_DIRECTIVE) continue;
+        if (e.value == DIR_MACRO || e.value == DIR_REP) depth++;
+        else if ((e.value == DIR_ENDM || e.value == DIR_ENDR) && --depth == 0) break;
+      }
+      if (end+1 == in.tokens.size() || in.tokens[end].value != (ismacro ? DIR_ENDM : DIR_ENDR))
+        { t = in.tokens.size() - 2; return !fail(tok, ismacro ? "Missing \'#endm\'." : "Missing \'#endr\'."); }
+      int start = in.tokens[h-1].pos + in.tokens[h-1].len; // the text behind the head, so the expansion starts in its line
+      body.text = text.substr(base + start, in.tokens[end].pos - start);
+      for (size_t b=h; b<end; b++)
+      {
+        Token btok = in.tokens[b]; btok.pos -= start;
+        if (btok.nterms > 0)
+        {
+          int term = body.terms.size();
+          for (int i=0; i<btok.nterms; i++) { Term bterm = in.terms[btok.term + i]; bterm.pos -= start; body.terms.push_back(bterm); }
+          btok.term = term;
+        }
+        body.tokens.push_back(btok);
+      }
+      t = end;
+      if (ismacro) return macros.emplace(name, std::move(body)).second || !fail(tok, "Macro \'" + name + "\' already exists.");
+      std::vector<std::string> counter;
+      for (int i=0; i<count; i++)
+      {
+        if (!body.params.empty()) counter.assign(1, std::to_string(i));
+        if (!instantiate(tok, body, counter, "#rep " + std::to_string(i) + at, from, out)) return false;
+      }
+      return true;
+    }
+    // The text of an expansion: 'values' replace the names of the parameters, local labels get the suffix ~id
+    std::string generate(const Macro& body, const std::vector<std::string>& values, int id) const
+    {
+      std::string_view btext = body.text;
+      std::set<std::string_view> locals; // labels starting with '.' defined in the body
+      for (const Token& tok : body.tokens)
+        if (tok.kind == TK_LABEL && btext[tok.pos] == '.') locals.insert(btext.substr(tok.pos, tok.len-1));
+      std::string suffix = "~" + std::to_string(id), out;
+      out.reserve(btext.size() + 64);
+      auto name = [&](std::string_view n) // replaced name
+      {
+        for (size_t i=0; i<body.params.size(); i++) if (n == body.params[i]) { out += values[i]; return; }
+        out += n;
+        if (locals.count(n)) out += suffix;
+      };
+      int p = 0; // copied up to here
+      for (const Token& tok : body.tokens)
+      {
+        if (tok.kind == TK_LABEL) { out += btext.substr(p, tok.pos - p); name(btext.substr(tok.pos, tok.len-1)); p = tok.pos + tok.len - 1; }
+        for (int i=tok.term; i<tok.term+tok.nterms; i++)
+        {
+          const Term& term = body.terms[i];
+          if (term.type != Term::LABEL) continue;
+          out += btext.substr(p, term.pos - p); name(btext.substr(term.pos, term.len)); p = term.pos + term.len;
+        }
+      }
+      out += btext.substr(p);
+      return out;
+    }
+    // Appends an expansion to the text, lexes it and expands it in turn
+    bool instantiate(const Token& tok, const Macro& body, const std::vector<std::string>& values, const std::string& name,
+                     const std::filesystem::path& from, TokenStream& out)
+    {
+      if (depth == 0) outer = tok;
+      if (depth == 64) return !fail(outer, "Macros are nested too deeply."); // reported where the recursion starts
+      if (text.back() != '\n') text += '\n';
+      int start = text.size();
+      text += generate(body, values, ++expansions);
+      text += '\n';
+      diag.Include(text, start, name);
+      if (islisting) // the expanded lines
+      {
+        diag.Note(name + ":");
+        for (size_t p = start, e; p < text.size(); p = e + 1)
+        {
+          e = text.find('\n', p);
+          std::string_view line = std::string_view(text).substr(p, e - p);
+          if (line.find_first_not_of(" \t\r") != std::string_view::npos) diag.Note("  " + std::string(line));
+        }
+      }
+      TokenStream ts;
+      Tokenize(text, ts, start, 1, false);
+      ts.tokens.push_back({ int(text.size()), 0, 0, TK_END, 0, 0, 0, 0, 0 });
+      depth++;
+      bool isok = expand(ts, 0, from, name, out);
+      depth--;
+      return isok;
+    }
+    std::string text;
+    std::filesystem::path dir; // directory of the source, include paths are relative to the including file
+    Diagnostics& diag;
+    std::unordered_map<std::string, int> bases; // start of each included file in 'text'
+    std::set<std::string> onces; // files with '#once' that were included already
+    std::vector<std::string> stack, paths; // files being included, all included and imported files
+    std::vector<Import> imports;
+    std::vector<std::shared_ptr<IncludeCache::File>> held; // the symbols of imported files are referenced
+    std::unordered_map<std::string, Macro> macros;
+    int expansions = 0, depth = 0; // expansions so far (for the suffix of local labels), nested ones
+    Token outer{}; // the outermost expansion
+    bool islisting; // notes show the lines of every expansion (Options::listing)
+};
+
+class ThreadPool // work-stealing pool: workers take jobs from the front of their own queue, idle ones steal from the back of others
+{
+  public:
+    ThreadPool(int threads) : queues(std::max(1, threads)) {}
+    void Add(std::function<void()> job) { queues[next++ % queues.size()].jobs.push_back(std::move(job)); } // only before Run()
+    void Run() // executes all jobs, returns when all of them are done
+    {
+      std::vector<std::thread> workers;
+      for (size_t w=1; w<queues.size(); w++) workers.emplace_back([this, w] { work(w); });
+      work(0);
+      for (std::thread& t : workers) t.join();
+    }
+  protected:
+    struct Queue { std::mutex lock; std::deque<std::function<void()>> jobs; };
+    bool take(size_t w, std::function<void()>& job)
+    {
+      for (size_t i=0; i<queues.size(); i++)
+      {
+        Queue& q = queues[(w + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.jobs.empty()) continue;
+        if (i == 0) { job = std::move(q.jobs.front()); q.jobs.pop_front(); }
+        else { job = std::move(q.jobs.back()); q.jobs.pop_back(); }
+        return true;
+      }
+      return false; // no jobs are added while running, so all queues stay empty
+    }
+    void work(size_t w) { std::function<void()> job; while (take(w, job)) job(); }
+    std::vector<Queue> queues;
+    size_t next = 0;
+};
+
+// PASS 1 (isparse = false): only checks for errors, PASS 2: (isparse = true): also computes expression value
+// Input:  Set "isparse" and the pre-parsed element "tok".
+//         Prior to calling, check the element for being a label-def, long string, pre-proc command.
+// Output: a. Returns TRUE for success and FALSE if an error occured (or a poisoned symbol was used).
+//         b. Sets descriptive flags "isop", "isword", "islsb", "ismsb"
+//         c. Sets expression value "lsb" and "msb" (only if isparse == true)
+// needs access to the Printer to retrieve '*' address
+bool parseExpr(std::string_view src, const TokenStream& ts, const Token& tok, Diagnostics& diag,
+               SymbolTable& symbols,
+               bool& isop, bool& isword, bool& islsb, bool& ismsb, const bool isparse,
+               int& lsb, int& msb, Printer& hex)
+{
+  isop = isword = islsb = ismsb = false; // all flags off
+
+  if (tok.kind == TK_MNEMONIC) { lsb = tok.value; isop = true; return true; }
+  if (tok.err) { diag.Error(tok.pos, EXPR_ERRORS[tok.err]); return false; }
+
+  isword = tok.flags & TF_WORD; islsb = tok.flags & TF_LSB; ismsb = tok.flags & TF_MSB;
+  if (!isparse) return true; // only possible during pass 2
+
+  auto label = [&](int i, int& value) // value of a label term
+  {
+    const Term& t = ts.terms[i];
+    std::string_view ref = src.substr(t.pos, t.len); // view of this reference
+    int sym = symbols.Find(ref); // is it a known label?
+    if (sym == -1)
+    {
+      diag.Error(tok.pos, "Unknown reference \'" + std::string(ref) + "\'.");
+      if (diag.IsCollecting()) symbols.Poison(symbols.Insert(ref, 0)); // report each unknown name only once
+      return false;
+    }
+    if (symbols.IsPoisoned(sym)) return false; // no follow-up errors of a broken symbol
+    value = symbols.Value(sym);
+    return true;
+  };
+  int expr = tok.value; // init result with all constant terms
+  if (tok.flags & TF_RPN) // a program
+  {
+    int err = runExpr(ts, tok, hex.GetAddress(), label, expr);
+    if (err > 0) diag.Error(tok.pos, EXPR_ERRORS[err]);
+    if (err != 0) return false;
+  }
+  else
+    for (int i=tok.term; i<tok.term+tok.nterms; i++)
+    {
+      const Term& t = ts.terms[i];
+      int value;
+      if (t.type == Term::STAR) expr += t.sign * hex.GetAddress();
+      else if (!label(i, value)) return false;
+      else expr += t.sign * value;
+    }
+
+  lsb = expr & 0xff; msb = (expr >> 8) & 0xff; // store resulting LSB/MSB
+  return true; // success
+}
+
+// '#bytes counter first last expr' and '#words ..' emit the value of 'expr' for each value first..last of the counter.
+// Its labels are looked up once, the counter is bound to each value in turn, so even 64KB tables take milliseconds.
+struct Table
+{
+  const Token *counter, *expr;
+  int first, last, width; // width: 1 (#bytes) or 2 (#words, LSB first)
+  const char* Read(const TokenStream& ts, int t) // the arguments of the directive at t, returns an error or nullptr
+  {
+    for (int i=0; i<4; i++) if (ts.tokens[t+i].kind == TK_END) return "Expecting a counter, a range and an expression.";
+    const Token &c = ts.tokens[t+1], &a = ts.tokens[t+2], &b = ts.tokens[t+3], &e = ts.tokens[t+4];
+    width = ts.tokens[t].value == DIR_WORDS ? 2 : 1; counter = &c; expr = &e; first = a.value; last = b.value;
+    if (c.kind != TK_EXPR || c.nterms != 1 || c.value != 0 || c.flags != TF_WORD || ts.terms[c.term].type != Term::LABEL ||
+        ts.terms[c.term].len != c.len) return "Expecting a counter name.";
+    if (a.kind != TK_NUMBER || b.kind != TK_NUMBER || a.err || b.err) return "Expecting a range like 0 255.";
+    if (last < first || last - first >= 0x10000) return "Invalid table range.";
+    if ((e.kind != TK_NUMBER && e.kind != TK_EXPR) || e.err) return e.err ? EXPR_ERRORS[e.err] : "Expecting an expression.";
+    return nullptr;
+  }
+  int Size() const { return (last - first + 1) * width; }
+  bool Emit(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, Diagnostics& diag, Printer& hex,
+            bool isemit) const // false: an error
+  {
+    std::string_view name = src.substr(counter->pos, counter->len);
+    std::vector<int> values(expr->nterms, -1); // of the labels, -1: the counter
+    for (int k=0; k<expr->nterms; k++)
+    {
+      const Term& term = ts.terms[expr->term + k];
+      std::string_view ref = src.substr(term.pos, term.len);
+      if (term.type != Term::LABEL || ref == name) continue;
+      int sym = symbols.Find(ref);
+      if (sym == -1) { diag.Error(expr->pos, "Unknown reference \'" + std::string(ref) + "\'."); return false; }
+      if (symbols.IsPoisoned(sym)) return false;
+      values[k] = symbols.Value(sym);
+    }
+    auto fail = [&](const char* message, int i) // names the value of the counter, made only for an error
+      { diag.Error(expr->pos, message, ", " + std::string(name) + "=" + std::to_string(i)); return false; };
+    for (int i=first; i<=last; i++)
+    {
+      auto label = [&](int k, int& value) { value = values[k - expr->term] == -1 ? i : values[k - expr->term]; return true; };
+      int value = expr->value, err = 0;
+      if (expr->flags & TF_RPN) err = runExpr(ts, *expr, hex.GetAddress(), label, value);
+      else
+        for (int k=expr->term; k<expr->term+expr->nterms; k++)
+        {
+          int v = hex.GetAddress();
+          if (ts.terms[k].type == Term::LABEL) label(k, v);
+          value += ts.terms[k].sign * v;
+        }
+      if (err) return fail(EXPR_ERRORS[err], i);
+      if (expr->flags & TF_LSB) value &= 0xff;
+      else if (expr->flags & TF_MSB) value = (value >> 8) & 0xff;
+      else if (width == 1 && (value > 255 || value < -128)) return fail("Expecting byte expression.", i);
+      if (isemit) { hex.Emit(value & 0xff); if (width == 2) hex.Emit((value >> 8) & 0xff); }
+    }
+    return true;
+  }
+};
+
+// Where the time of an assembly went and what its source contains (Options::stats). Only the phase boundaries and the
+// rare directives are recorded while assembling, everything else is counted from the tokens afterwards.
+struct Stats
+{
+  enum Phase { READ, LEX, PASS1, SYMBOLS, PASS2, OUTPUT, PHASES };
+  struct Segment { int addr, bytes; }; // emitted from an '#org' while emitting (addr -1: before the first one)
+  double wall[PHASES], cpu[PHASES]; // ms
+  int elements, labels, references, ops[256], directives[DIR_UNKNOWN+1];
+  std::vector<Segment> segments;
+  int symbols, slots, longest; long long probes;
+  long long peakkb;
+  Stats() { Reset(); }
+  void Reset() // keeps the running phase
+  {
+    std::fill(wall, wall + PHASES, 0); std::fill(cpu, cpu + PHASES, 0);
+    elements = labels = references = symbols = slots = longest = 0; probes = peakkb = 0;
+    std::fill(ops, ops + 256, 0); std::fill(directives, directives + DIR_UNKNOWN + 1, 0);
+    Restart();
+  }
+  void Start() { wallstart = std::chrono::steady_clock::now(); cpustart = std::clock(); }
+  void Stop(Phase phase) // adds the time since Start() or the last Stop() to 'phase'
+  {
+    auto now = std::chrono::steady_clock::now(); std::clock_t cpunow = std::clock();
+    wall[phase] += std::chrono::duration<double, std::milli>(now - wallstart).count();
+    cpu[phase] += (cpunow - cpustart) * 1000.0 / CLOCKS_PER_SEC;
+    wallstart = now; cpustart = cpunow;
+  }
+  void Restart() { segments.assign(1, { -1, 0 }); mark = 0; } // pass 1 starts (again)
+  void Emitted(int pc, bool isemit) { if (isemit) segments.back().bytes += pc - mark; mark = pc; } // pass 1 up to pc
+  void Org(int pc, bool isemit) { if (isemit) segments.push_back({ pc, 0 }); mark = pc; } // muted: only the pc moves
+  void Collect(const TokenStream& ts, const SymbolTable& table)
+  {
+    for (const Token& tok : ts.tokens)
+    {
+      if (tok.kind == TK_MNEMONIC) ops[tok.value]++;
+      else if (tok.kind == TK_DIRECTIVE) directives[tok.value]++;
+      else if (tok.kind == TK_LABEL) labels++;
+      for (int k=tok.term; k<tok.term+tok.nterms; k++) references += ts.terms[k].type == Term::LABEL;
+    }
+    elements = ts.tokens.size() - 1;
+    symbols = table.Size(); slots = table.Slots(); table.Probes(probes, longest);
+#ifndef _WIN32
+    rusage usage; getrusage(RUSAGE_SELF, &usage);
+  #ifdef __APPLE__
+    peakkb = usage.ru_maxrss / 1024; // bytes
+  #else
+    peakkb = usage.ru_maxrss;
+  #endif
+#endif
+  }
+  void Print(std::ostream& out, bool isjson) const
+  {
+    static const char* PHASE[] = { "read", "lex", "pass 1", "symbols", "pass 2", "output" };
+    static const char* DIRECTIVE[] = { "#org", "#page", "#mute", "#emit", "#include", "#once", "#import", "#var", "#zp", "#data",
+                                       "#macro", "#endm", "#rep", "#endr", "#bytes", "#words", "#entry",
+                                       "unknown" };
+    std::vector<int> order; // op codes by frequency
+    for (int op=0; op<256; op++) if (ops[op] > 0) order.push_back(op);
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return ops[a] > ops[b]; });
+    char line[160];
+    if (isjson)
+    {
+      out << "{\"phases\":{";
+      for (int p=0; p<PHASES; p++)
+        { snprintf(line, sizeof(line), "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", p ? "," : "", PHASE[p], wall[p], cpu[p]); out << line; }
+      out << "},\"elements\":" << elements << ",\"label_definitions\":" << labels << ",\"label_references\":" << references;
+      out << ",\"instructions\":{";
+      for (size_t i=0; i<order.size(); i++) out << (i ? "," : "") << "\"" << MNEMONICS[order[i]] << "\":" << ops[order[i]];
+      out << "},\"directives\":{";
+      for (int d=0, n=0; d<=DIR_UNKNOWN; d++) if (directives[d] > 0) out << (n++ ? "," : "") << "\"" << DIRECTIVE[d] << "\":" << directives[d];
+      out << "},\"segments\":[";
+      for (size_t i=0, n=0; i<segments.size(); i++)
+        if (segments[i].bytes > 0) out << (n++ ? "," : "") << "{\"org\":" << segments[i].addr << ",\"bytes\":" << segments[i].bytes << "}";
+      out << "],\"symbol_table\":{\"symbols\":" << symbols << ",\"slots\":" << slots << ",\"probes\":" << probes
+          << ",\"longest_probe\":" << longest << "},\"peak_kb\":" << peakkb << "}\n";
+      return;
+    }
+    out << "phase      wall ms   cpu ms\n";
+    for (int p=0; p<PHASES; p++) { snprintf(line, sizeof(line), "%-8s %9.3f %8.3f\n", PHASE[p], wall[p], cpu[p]); out << line; }
+    out << elements << " elements, " << labels << " label definitions, " << references << " label references\n";
+    out << "instructions:";
+    for (size_t i=0; i<order.size(); i++) out << (i % 10 ? " " : "\n  ") << MNEMONICS[order[i]] << " " << ops[order[i]];
+    out << "\ndirectives:";
+    for (int d=0; d<=DIR_UNKNOWN; d++) if (directives[d] > 0) out << " " << DIRECTIVE[d] << " " << directives[d];
+    out << "\nbytes emitted per #org:";
+    for (size_t i=0, n=0; i<segments.size(); i++)
+      if (segments[i].bytes > 0)
+      {
+        if (segments[i].addr < 0) snprintf(line, sizeof(line), "%s(start) %d", n++ % 6 ? ", " : "\n  ", segments[i].bytes);
+        else snprintf(line, sizeof(line), "%s0x%04x %d", n++ % 6 ? ", " : "\n  ", segments[i].addr, segments[i].bytes);
+        out << line;
+      }
+    snprintf(line, sizeof(line), "\nsymbol table: %d symbols in %d slots, %.2f probes per lookup, %d at most\n", symbols, slots,
+             symbols ? double(probes) / symbols : 0.0, longest);
+    out << line;
+    if (peakkb > 0) out << "peak memory: " << peakkb << " KB\n";
+  }
+  protected:
+    std::chrono::steady_clock::time_point wallstart;
+    std::clock_t cpustart = 0;
+    int mark = 0; // pc of the last recorded emission
+};
+
+struct Products // what assembling yields besides the output
+{
+  std::vector<std::string> includes; // canonical paths of all included and imported files
+  std::string symbols; // binary symbol file (Options::doexport)
+  Stats stats; // Options::stats
+};
+
+constexpr int opIndex(std::string_view name) // op code of a mnemonic
+{
+  for (int op=0; op<256; op++) if (name == MNEMONICS[op]) return op;
+  return -1;
+}
+
+int fastJump(int op) // the fast page-local form of a jump (Bxx -> Fxx, JPA -> FPA), -1: none
+{
+  constexpr int BNE = opIndex("BNE"), BLE = opIndex("BLE"), FNE = opIndex("FNE"), JPA = opIndex("JPA"), FPA = opIndex("FPA");
+  static_assert(BLE - BNE == opIndex("FLE") - FNE, "Bxx and Fxx are in the same order");
+  if (op >= BNE && op <= BLE) return op - BNE + FNE;
+  return op == JPA ? FPA : -1;
+}
+
+bool isFastJump(int op) { return op >= opIndex("FNE") && op <= opIndex("FPA"); } // Fxx and FPA
+
+bool isLabel(const TokenStream& ts, int t) // a label definition, but not the name of a '#var'
+  { return ts.tokens[t].kind == TK_LABEL && !(t > 0 && ts.tokens[t-1].kind == TK_DIRECTIVE && ts.tokens[t-1].value == DIR_VAR); }
+
+// Blocks start at labels. A block is frozen if '*' is used in it or a label plus an offset (or any arithmetic on a
+// label) points into it or across it, or if it is an entry of a jump table (one of several blocks of a single JPA in a
+// row, e.g. the API of MinOS): its code keeps its size (Options::optimize, Options::relax). Based on pass 1.
+class Freezer
+{
+  public:
+    void Find(std::string_view src, const TokenStream& ts, const SymbolTable& symbols)
+    {
+      constexpr int JPA = opIndex("JPA");
+      blockof.assign(symbols.Size(), -1); frozen.assign(1, 0); starts.assign(1, -1); isjump.assign(1, 0);
+      for (size_t t=0; t<ts.tokens.size(); t++)
+        if (isLabel(ts, t))
+        {
+          const Token& tok = ts.tokens[t];
+          frozen.push_back(0);
+          int k = symbols.Find(src.substr(tok.pos, tok.len-1));
+          if (k != -1 && blockof[k] == -1) blockof[k] = frozen.size() - 1;
+          starts.push_back(k != -1 && blockof[k] == int(frozen.size()) - 1 ? symbols.Value(k) : -1); // -1: a duplicate
+          isjump.push_back(ts.tokens[t+1].kind == TK_MNEMONIC && ts.tokens[t+1].value == JPA);
+        }
+      int n = frozen.size();
+      for (int b=1; b<n; b++) isjump[b] = isjump[b] && b+1 < n && starts[b] != -1 && starts[b+1] == starts[b] + 3; // JPA only
+      for (int b=1; b<n; b++) if (isjump[b] && (isjump[b-1] || (b+1 < n && isjump[b+1]))) frozen[b] = 1;
+      int block = 0;
+      for (size_t t=0; t<ts.tokens.size(); t++)
+      {
+        const Token& tok = ts.tokens[t];
+        if (isLabel(ts, t)) block++;
+        for (int i=tok.term; i<tok.term+tok.nterms; i++)
+        {
+          const Term& term = ts.terms[i];
+          if (term.type == Term::STAR) frozen[block] = 1;
+          else if (term.type == Term::LABEL && (tok.value != 0 || (tok.flags & TF_RPN)))
+          {
+            int k = symbols.Find(src.substr(term.pos, term.len));
+            if (k == -1 || blockof[k] == -1) continue;
+            int b = blockof[k];
+            frozen[b] = 1;
+            if (tok.nterms != 1 || (tok.flags & TF_RPN) || term.sign != 1 || starts[b] == -1) continue;
+            int addr = starts[b] + tok.value; // the blocks between the label and label+offset
+            for (int a=b+1; a<n && starts[a] > starts[b] && starts[a] <= addr; a++) frozen[a] = 1;
+            for (int a=b-1; a>=0 && starts[a+1] > addr && starts[a+1] <= starts[b]; a--) frozen[a] = 1;
+          }
+        }
+      }
+    }
+    bool IsFrozen(int block) const { return frozen[block]; }
+  protected:
+    std::vector<uint8_t> frozen, isjump; // per block between labels, isjump: a single JPA
+    std::vector<int> blockof; // per symbol: the block its definition starts
+    std::vector<int> starts; // per block: pc of its label, -1: unknown
+};
+
+struct Layout // what moves when a jump gets shorter: recorded by pass 1 (Options::relax) in source order
+{
+  enum : uint8_t { LABEL, JUMP, ORG, PAGE } kind;
+  int pc; // pc of pass 1 (JUMP: of its op code, PAGE: before the alignment)
+  int ref; // LABEL: symbol index, JUMP: token index of the op code (a jump or a fast jump of the source)
+  int at; // JUMP: pc of the current layout
+  int label = -1, offset = 0; // JUMP: its target label + offset, -1: none that relaxation can follow
+};
+
+// Turns jumps into their fast page-local form wherever the target lies in the page of the operand byte. Each shorter
+// jump moves the code behind it, so the layout is repeated until nothing changes. A fast jump that no longer fits is
+// made long again for good: every jump changes at most twice and the result doesn't depend on anything but the source.
+// The fast jumps of the source must keep fitting: if one doesn't, the nearest relaxed jump in front of it (or else
+// behind it) is made long again, in the end all of them would be, which is the layout of the source.
+// Jumps of frozen blocks stay as they are. Updates the labels, marks the relaxed jumps with 1 in 'relaxed' (per token)
+// and returns their number.
+int relaxJumps(std::string_view src, const TokenStream& ts, std::vector<Layout>& events, SymbolTable& symbols,
+               std::vector<uint8_t>& relaxed, Freezer& freezer)
+{
+  enum : uint8_t { LONG, FAST, PINNED, GUARD }; // PINNED: long (or fast as in the source) for good, GUARD: must keep fitting
+  relaxed.assign(ts.tokens.size(), LONG);
+  auto isnear = [](const Layout& e, int value) { return ((value >> 8) & 0xff) == (((e.at + 1) >> 8) & 0xff); }; // page of the operand byte
+  auto target = [&](const Layout& e, int& value) // false: the target can't be known
+  {
+    if (e.label == -1) return false;
+    value = symbols.Value(e.label) + e.offset;
+    return true;
+  };
+  freezer.Find(src, ts, symbols);
+  int block = 0, t = 0;
+  for (Layout& e : events)
+    if (e.kind == Layout::JUMP)
+    {
+      for (; t < e.ref; t++) if (isLabel(ts, t)) block++;
+      const Token& arg = ts.tokens[e.ref + 1]; // only 'label' or 'label+-constant' moves with the code
+      const Term* term = arg.nterms == 1 ? &ts.terms[arg.term] : nullptr;
+      if (arg.kind == TK_EXPR && !arg.err && !(arg.flags & (TF_LSB | TF_MSB)) && term && term->type == Term::LABEL && term->sign == 1)
+      {
+        int k = symbols.Find(src.substr(term->pos, term->len));
+        if (k != -1 && !symbols.IsPoisoned(k)) { e.label = k; e.offset = arg.value; }
+      }
+      int value; bool isknown = target(e, value);
+      if (!isFastJump(ts.tokens[e.ref].value)) relaxed[e.ref] = isknown && !freezer.IsFrozen(block) ? LONG : PINNED;
+      else relaxed[e.ref] = isknown && (value & 0xff00) != 0 && isnear(e, value) ? GUARD : PINNED; // zero page: always fits
+    }
+  for (bool ischanged = true; ischanged;)
+  {
+    int shift = 0; // how much the current layout moved the code here
+    for (Layout& e : events)
+    {
+      int pc = e.pc + shift;
+      if (e.kind == Layout::LABEL) symbols.SetValue(e.ref, pc);
+      else if (e.kind == Layout::JUMP) { e.at = pc; if (relaxed[e.ref] == FAST) shift--; } // one operand byte less
+      else if (e.kind == Layout::ORG) shift = 0;
+      else shift = ((pc + 0xff) & ~0xff) - ((e.pc + 0xff) & ~0xff); // #page
+    }
+    ischanged = false;
+    for (size_t i=0; i<events.size(); i++)
+    {
+      const Layout& e = events[i];
+      int value;
+      if (e.kind != Layout::JUMP || relaxed[e.ref] == PINNED || !target(e, value)) continue;
+      if (relaxed[e.ref] == FAST && !isnear(e, value)) { relaxed[e.ref] = PINNED; ischanged = true; }
+      else if (relaxed[e.ref] == LONG && isnear(e, value)) { relaxed[e.ref] = FAST; ischanged = true; }
+      else if (relaxed[e.ref] == GUARD && !isnear(e, value))
+      {
+        auto isfast = [&](const Layout& f) { return f.kind == Layout::JUMP && relaxed[f.ref] == FAST; };
+        auto before = std::find_if(events.rbegin() + (events.size() - i), events.rend(), isfast);
+        if (before != events.rend()) relaxed[before->ref] = PINNED;
+        else relaxed[std::find_if(events.begin() + i, events.end(), isfast)->ref] = PINNED; // one must exist
+        ischanged = true; break; // the layout changes
+      }
+    }
+  }
+  int fast = 0;
+  for (const Layout& e : events) fast += e.kind == Layout::JUMP && relaxed[e.ref] == FAST;
+  return fast;
+}
+
+// Zero-page forms of instructions with absolute operands (Options::optimize, '#var'), width: bytes used at the address
+struct Form { int from, to, width; };
+constexpr Form form(std::string_view from, std::string_view to, int width) { return { opIndex(from), opIndex(to), width }; }
+constexpr Form FORMS[] = {
+  form("LLB","LLZ",1), form("RLB","RLZ",1), form("LRB","LRZ",1), form("RRB","RRZ",1), form("NOB","NOZ",1),
+  form("NEB","NEZ",1), form("ANB","ANZ",1), form("BAN","ZAN",1), form("ORB","ORZ",1), form("BOR","ZOR",1),
+  form("XRB","XRZ",1), form("BXR","ZXR",1), form("LDB","LDZ",1), form("SDB","SDZ",1), form("CLB","CLZ",1),
+  form("INB","INZ",1), form("DEB","DEZ",1), form("ADB","ADZ",1), form("BAD","ZAD",1), form("SUB","SUZ",1),
+  form("BSU","ZSU",1), form("CPB","CPZ",1), form("AIB","AIZ",1), form("SIB","SIZ",1), form("CIB","CIZ",1),
+  form("MIB","MIZ",1), form("MBB","MZZ",1), form("MBB","MZB",1), form("MBB","MBZ",1), form("MBZ","MZZ",1),
+  form("MZB","MZZ",1), form("ABB","AZZ",1), form("SBB","SZZ",1), form("CBB","CZZ",1), form("LDR","LDT",2),
+  form("SDR","SDT",2), form("ANR","ANT",2), form("RAN","TAN",2), form("ORR","ORT",2), form("ROR","TOR",2),
+  form("XRR","XRT",2), form("RXR","TXR",2), form("ADR","ADT",2), form("RAD","TAD",2), form("SUR","SUT",2),
+  form("RSU","TSU",2), form("CPR","CPT",2), form("AIR","AIT",2), form("SIR","SIT",2), form("CIR","CIT",2),
+  form("MIR","MIT",2), form("MBT","MZT",1), form("MTB","MTZ",1), form("MBR","MZT",2), form("MBR","MZR",1),
+  form("MBR","MBT",2), form("MRB","MTZ",2), form("MRB","MRZ",1), form("MRB","MTB",2), form("MRZ","MTZ",2),
+  form("MZR","MZT",2), form("MRT","MTT",2), form("MTR","MTT",2), form("MRR","MTT",2), form("MRR","MRT",2),
+  form("MRR","MTR",2), form("LLW","LLV",2), form("RLW","RLV",2), form("NOW","NOV",2), form("NEW","NEV",2),
+  form("CLW","CLV",2), form("INW","INV",2), form("DEW","DEV",2), form("ADW","ADV",2), form("SUW","SUV",2),
+  form("AIW","AIV",2), form("SIW","SIV",2), form("CIW","CIV",2), form("MIW","MIV",2), form("MWV","MVV",2),
+  form("ABW","AZV",2), form("SBW","SZV",2), form("LLL","LLQ",4), form("RLL","RLQ",4), form("CLL","CLQ",4) };
+
+// Instructions that only differ in the addressing of their operands: the families connected by FORMS
+struct Families { uint8_t of[256]; uint8_t width[256]; }; // of: lowest op code of the family, width: per family
+constexpr Families makeFamilies()
+{
+  Families f{};
+  for (int op=0; op<256; op++) f.of[op] = op;
+  for (bool ischanged = true; ischanged;)
+  {
+    ischanged = false;
+    for (const Form& x : FORMS)
+    {
+      uint8_t low = std::min(f.of[x.from], f.of[x.to]);
+      if (f.of[x.from] != low || f.of[x.to] != low) { f.of[x.from] = f.of[x.to] = low; ischanged = true; }
+    }
+  }
+  for (const Form& x : FORMS) f.width[f.of[x.from]] = std::max<int>(f.width[f.of[x.from]], x.width);
+  return f;
+}
+constexpr Families FAMILIES = makeFamilies();
+
+// Peephole optimizer (Options::optimize): rewrites windows of consecutive instructions into equivalent ones of fewer
+// cycles. None of the rewrites touches the flags, and A holds the same value afterwards (a move only replaces a load
+// and a store if the next instruction loads A anyway):
+//   absolute forms (B, W, L, R) -> zero-page forms (Z, V, Q, T) where the address lies below 0x100
+//   LDI 0 SDZ a SDZ a+1 (a+2 a+3) -> CLV a (CLQ a), the same with SDB -> CLW a (CLL a)
+//   SDZ a LDZ a -> SDZ a, LDZ a SDZ a -> LDZ a, SDx a SDx a -> SDx a, LDx a LDy b -> LDy b
+//   LDx a SDy b -> Mxy a,b
+// Windows never span a label. Code addressed by '*' or by a label plus an offset (self-modifying code, computed
+// jumps) stays as it is. Decisions are based on the labels of pass 1: code only shrinks, so an address below 0x100
+// stays below 0x100, whatever pass 1 yields with the rewrites.
+constexpr int DROP = -2; // rewrites: the token is left out, -1: as written, else: op code of a mnemonic
+
+class Optimizer
+{
+  public:
+    struct Window { int first, last, cycles, bytes, check, width; bool isactive; }; // tokens first..last, check: the
+                                                                                      // address of an absolute clear
+    // Decides the rewrites of 'ts' based on the labels of pass 1 and on top of those in 'rewrites' (of the allocator),
+    // returns the number of windows
+    int Run(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, std::vector<int16_t>& rewrites)
+    {
+      constexpr int CLW = opIndex("CLW");
+      if (rewrites.empty()) rewrites.assign(ts.tokens.size(), -1);
+      base = rewrites; code.clear(); windows.clear();
+      freezer.Find(src, ts, symbols);
+      int block = 0, run = 0; // instructions code[run..] follow each other
+      for (int t=0; ts.tokens[t].kind != TK_END; t++)
+      {
+        const Token& tok = ts.tokens[t];
+        if (isLabel(ts, t)) block++;
+        int op = base[t] >= 0 ? base[t] : tok.value;
+        Instr in { t, op, op, { -1, -1 }, 0, -1, false, false };
+        if (tok.kind != TK_MNEMONIC || base[t] == DROP || freezer.IsFrozen(block) || !parse(ts, in)) { optimize(src, ts, symbols, run); run = code.size(); continue; }
+        code.push_back(in); t += in.nargs;
+      }
+      optimize(src, ts, symbols, run);
+      for (size_t i=0; i<code.size(); i++) // the chains of joined instructions that changed become windows
+      {
+        size_t j = i; bool ischanged = false; int cycles = 0, bytes = 0, check = -1, width = 0;
+        for (;; j++)
+        {
+          const Instr& in = code[j];
+          ischanged |= in.isdrop || in.op != in.orig;
+          cycles += CYCLES[in.orig] - (in.isdrop ? 0 : CYCLES[in.op]);
+          bytes += size(in.orig) - (in.isdrop ? 0 : size(in.op));
+          if (in.check != -1) { check = in.check; width = in.op == CLW ? 2 : 4; }
+          if (!in.isjoined) break;
+        }
+        if (ischanged)
+        {
+          const Instr& last = code[j];
+          windows.push_back({ code[i].tok, last.tok + argCount(last.orig), cycles, bytes, check, width, true });
+          for (int t=windows.back().first; t<=windows.back().last; t++) rewrites[t] = DROP;
+          for (size_t k=i; k<=j; k++)
+            if (!code[k].isdrop) { rewrites[code[k].tok] = code[k].op; for (int a=0; a<code[k].nargs; a++) rewrites[code[k].args[a]] = -1; }
+        }
+        i = j;
+      }
+      return windows.size();
+    }
+    // Remembers the fast jumps of the source that fit (JUMP events of pass 1 without the rewrites)
+    void Guard(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, const std::vector<Layout>& layout)
+    {
+      guards.clear();
+      for (const Layout& e : layout)
+        if (e.kind == Layout::JUMP && isFastJump(ts.tokens[e.ref].value) && fits(src, ts, symbols, e)) guards.push_back(e.ref);
+    }
+    // Checks the layout of pass 1 with the rewrites, false: one window was reverted and pass 1 has to run again
+    bool Verify(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, const std::vector<Layout>& layout,
+                std::vector<int16_t>& rewrites)
+    {
+      for (Window& w : windows) // an absolute clear must not cross a page
+      {
+        int value;
+        if (w.isactive && w.check != -1 && (!valueOf(src, ts, symbols, ts.tokens[w.check], value) || (value & 0xff) + w.width > 0x100))
+          { revert(w, rewrites); return false; }
+      }
+      size_t g = 0;
+      for (const Layout& e : layout) // a fast jump of the source must keep fitting
+      {
+        if (e.kind != Layout::JUMP || g == guards.size() || e.ref != guards[g]) continue;
+        g++;
+        if (fits(src, ts, symbols, e)) continue;
+        auto before = std::find_if(windows.rbegin(), windows.rend(), [&](const Window& w) { return w.isactive && w.last < e.ref; });
+        if (before != windows.rend()) revert(*before, rewrites);
+        else revert(*std::find_if(windows.begin(), windows.end(), [](const Window& w) { return w.isactive; }), rewrites);
+        return false;
+      }
+      return true;
+    }
+    // Reports every rewrite that remained and the cycles saved
+    void Report(std::string_view src, const TokenStream& ts, const std::vector<int16_t>& rewrites, Diagnostics& diag) const
+    {
+      int n = 0, cycles = 0, bytes = 0;
+      for (const Window& w : windows) if (w.isactive) { n++; cycles += w.cycles; bytes += w.bytes; }
+      diag.Note("Optimized " + std::to_string(n) + " windows, " + std::to_string(cycles) + " cycles and " + std::to_string(bytes) + " bytes saved.");
+      auto render = [&](const Window& w, bool isafter) // 'LDB a SDB b' or 'MZZ a,b'
+      {
+        std::string text;
+        for (int t=w.first; t<=w.last; t++)
+        {
+          const Token& tok = ts.tokens[t];
+          if (isafter && rewrites[t] == DROP) continue;
+          if (tok.kind == TK_MNEMONIC)
+            { text += text.empty() ? "" : " "; text += MNEMONICS[isafter ? rewrites[t] : base[t] >= 0 ? base[t] : tok.value]; text += ' '; }
+          else { if (text.back() != ' ') text += ','; text += src.substr(tok.pos, tok.len); }
+        }
+        if (text.back() == ' ') text.pop_back();
+        return text;
+      };
+      for (const Window& w : windows)
+        if (w.isactive)
+          diag.Note(diag.Where(ts.tokens[w.first].pos) + ": " + render(w, false) + " -> " + render(w, true) + " (" +
+                    std::to_string(w.cycles) + " cycles, " + std::to_string(w.bytes) + " bytes)");
+    }
+  protected:
+    struct Instr { int tok, op, orig, args[2], nargs, check; bool isdrop, isjoined; }; // isjoined: with the next one, check: see Window
+    std::vector<Instr> code;
+    std::vector<Window> windows;
+    std::vector<int16_t> base; // rewrites before the optimizer
+    std::vector<int> guards; // op tokens of fast jumps
+    Freezer freezer; // blocks between labels that keep their code
+
+    static int argCount(int op) { int n = 0; for (int a = ARGS[op]; a; a >>= 4) n++; return n; }
+    static int size(int op) { int n = 1; for (int a = ARGS[op]; a; a >>= 4) n += (a & 0x0f) == 3 ? 2 : 1; return n; }
+    static bool valueOf(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, const Token& tok, int& value)
+    {
+      value = tok.value;
+      if (tok.flags & TF_RPN) return false;
+      for (int i=tok.term; i<tok.term+tok.nterms; i++)
+      {
+        const Term& term = ts.terms[i];
+        int k = term.type == Term::LABEL ? symbols.Find(src.substr(term.pos, term.len)) : -1;
+        if (k == -1 || symbols.IsPoisoned(k)) return false;
+        value += term.sign * symbols.Value(k);
+      }
+      return true;
+    }
+    static bool fits(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, const Layout& e) // fast jump
+    {
+      int value; const Token& arg = ts.tokens[e.ref + 1];
+      if ((arg.kind != TK_NUMBER && arg.kind != TK_EXPR) || (arg.flags & (TF_LSB | TF_MSB)) || !valueOf(src, ts, symbols, arg, value)) return false;
+      return (value & 0xff00) == 0 || ((value >> 8) & 0xff) == (((e.pc + 1) >> 8) & 0xff);
+    }
+    void revert(Window& w, std::vector<int16_t>& rewrites)
+      { w.isactive = false; std::copy(base.begin() + w.first, base.begin() + w.last + 1, rewrites.begin() + w.first); }
+    bool same(std::string_view src, const TokenStream& ts, int a, int b, int delta) const // b is a + delta
+    {
+      const Token &x = ts.tokens[a], &y = ts.tokens[b];
+      if (x.value + delta != y.value || x.nterms != y.nterms || (x.flags & (TF_LSB | TF_MSB)) != (y.flags & (TF_LSB | TF_MSB))) return false;
+      for (int i=0; i<x.nterms; i++)
+      {
+        const Term &s = ts.terms[x.term+i], &t = ts.terms[y.term+i];
+        if (s.type != Term::LABEL || t.type != Term::LABEL || s.sign != t.sign || src.substr(s.pos, s.len) != src.substr(t.pos, t.len)) return false;
+      }
+      return true;
+    }
+    bool parse(const TokenStream& ts, Instr& in) const // an instruction whose arguments are one element each
+    {
+      for (int a = ARGS[in.op]; a; a >>= 4)
+      {
+        const Token& arg = ts.tokens[in.tok + 1 + in.nargs];
+        int type = a & 0x0f;
+        bool isword = (arg.flags & TF_WORD) && !(arg.flags & (TF_LSB | TF_MSB));
+        if ((arg.kind != TK_NUMBER && arg.kind != TK_EXPR) || arg.err || type == 4 || (type == 3 && !isword) || (type == 1 && isword) ||
+            (type == 2 && (arg.flags & TF_MSB)))
+          return false;
+        in.args[in.nargs] = in.tok + 1 + in.nargs; in.nargs++;
+      }
+      return true;
+    }
+    int next(int i, int end) const { do i++; while (i < end && code[i].isdrop); return i; }
+    void join(int i, int j) { for (int k=i; k<j; k++) code[k].isjoined = true; }
+    void optimize(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, int begin)
+    {
+      constexpr int LDI = opIndex("LDI"), LDZ = opIndex("LDZ"), LDR = opIndex("LDR"), SDZ = opIndex("SDZ"), SDB = opIndex("SDB"),
+                    SDR = opIndex("SDR");
+      auto isload = [](int op) { return op >= LDI && op <= LDR; }; // LDI LDZ LDB LDT LDR
+      auto isstore = [](int op) { return op >= SDZ && op <= SDR; }; // SDZ SDB SDT SDR
+      int end = code.size();
+
+      for (int i=begin; i<end; i++) // zero-page forms
+      {
+        Instr& in = code[i]; int best = -1;
+        for (auto [from, to, width] : FORMS)
+        {
+          if (from != in.op || (best != -1 && CYCLES[to] >= CYCLES[best]) || CYCLES[to] >= CYCLES[from]) continue;
+          bool isnear = true;
+          for (int a=0, x = ARGS[from], y = ARGS[to]; a<in.nargs; a++, x >>= 4, y >>= 4)
+          {
+            int value;
+            if ((x & 0x0f) == 3 && (y & 0x0f) == 2)
+              isnear &= valueOf(src, ts, symbols, ts.tokens[in.args[a]], value) && value >= 0 && value + width <= 0x100;
+          }
+          if (isnear) best = to;
+        }
+        if (best != -1) in.op = best;
+      }
+      for (int i=next(begin-1, end); i<end;) // redundant loads and stores
+      {
+        int j = next(i, end);
+        if (j == end) break;
+        Instr &x = code[i], &y = code[j];
+        bool isequal = x.nargs == 1 && y.nargs == 1 && same(src, ts, x.args[0], y.args[0], 0);
+        if (isequal && ((x.op == SDZ && y.op == LDZ) || (x.op == LDZ && y.op == SDZ) || ((x.op == SDZ || x.op == SDB) && y.op == x.op)))
+          { y.isdrop = true; join(i, j); } // x stays, look at the one after y
+        else if (isload(x.op) && isload(y.op)) { x.isdrop = true; join(i, j); i = j; } // the later load wins
+        else i = j;
+      }
+      for (int i=next(begin-1, end); i<end; i = next(i, end)) // clears and moves
+      {
+        Instr& x = code[i];
+        int j = next(i, end);
+        if (j == end) break;
+        const Token& imm = ts.tokens[x.args[0]];
+        int store = code[j].op, stores[4], n = 0, value;
+        if (x.op == LDI && imm.nterms == 0 && imm.value == 0 && !(imm.flags & (TF_LSB | TF_MSB)) && (store == SDZ || store == SDB))
+          for (int k=j; k<end && n<4 && code[k].op == store && same(src, ts, code[j].args[0], code[k].args[0], n); k = next(k, end))
+            stores[n++] = k;
+        if (n == 3) n = 2; // A is 0 for the third one anyway
+        if (n >= 2 && (store == SDZ || (valueOf(src, ts, symbols, ts.tokens[code[j].args[0]], value) && (value & 0xff) + n <= 0x100)))
+        {
+          x.op = opIndex(store == SDZ ? (n == 4 ? "CLQ" : "CLV") : (n == 4 ? "CLL" : "CLW")); // an absolute one within a page
+          x.args[0] = code[j].args[0]; x.check = store == SDB ? x.args[0] : -1;
+          for (int k=0; k<n; k++) code[stores[k]].isdrop = true;
+          join(i, stores[n-1]);
+          continue;
+        }
+        Instr& y = code[j];
+        int k = next(j, end); // A is dead after y?
+        if (isload(x.op) && isstore(y.op) && x.nargs == 1 && y.nargs == 1 && k < end && isload(code[k].op))
+        {
+          char name[4] = { 'M', MNEMONICS[x.op][2], MNEMONICS[y.op][2], 0 };
+          int move = opIndex(name);
+          if (move != -1 && CYCLES[move] < CYCLES[x.op] + CYCLES[y.op])
+            { x.op = move; x.args[1] = y.args[0]; x.nargs = 2; y.isdrop = true; join(i, j); }
+        }
+      }
+    }
+};
+
+// Allocator of the relocatable variables declared by '#var name: [size]'. Their references by instructions that have a
+// zero-page form are counted (inside loops 8 times per nesting level with Options::loopweight), the most used ones get
+// the free bytes of the zero page ('#zp 0x0000 0x007f' by default: MinOS uses 0x0080..0x00ff), the others follow the
+// highest emitted byte or start at '#data 0x....'. Zero-page bytes placed by the program and its zero-page labels are
+// not free. Instructions are rewritten into the form that matches the addresses of their variables, a variable used by
+// an instruction without absolute form must get the zero page.
+class Allocator
+{
+  public:
+    void Reset() { vars.clear(); isplanned = false; }
+    bool IsEmpty() const { return vars.empty(); }
+    void Rewind() { n = mark = top = 0; used.assign(0x100, 0); zpfirst = 0x00; zplast = 0x7f; data = -1; } // pass 1 starts
+    void Declare(std::string_view name, int size, int pos, int k) // in the same order in every pass 1, k: its symbol
+    {
+      if (n == vars.size()) vars.push_back({ name, pos, size, k, 0, 0, -1, false });
+      vars[n++].sym = k;
+    }
+    void Placed(int pc, bool isemit) // pass 1 placed the bytes from the last call or Moved() up to pc
+    {
+      for (int a=mark; a<std::min(pc, 0x100); a++) used[a] = 1;
+      if (isemit) top = std::max(top, pc);
+      mark = pc;
+    }
+    void Moved(int pc) { mark = pc; } // '#org', '#page'
+    void ZeroPage(int first, int last) { zpfirst = first; zplast = last; }
+    void Data(int addr) { data = addr; }
+    // Counts the references, assigns the addresses and rewrites the instructions, false: errors
+    bool Plan(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, bool isloopweighted,
+              std::vector<int16_t>& rewrites, Diagnostics& diag)
+    {
+      names.Clear();
+      for (size_t v=0; v<vars.size(); v++) names.Insert(vars[v].name, v);
+      depth.assign(ts.tokens.size() + 1, 0);
+      if (isloopweighted) // a jump back to a label closes a loop
+      {
+        labels.Clear();
+        for (int t=0; ts.tokens[t].kind != TK_END; t++)
+          if (isLabel(ts, t)) labels.Insert(src.substr(ts.tokens[t].pos, ts.tokens[t].len-1), t);
+        for (int t=0; ts.tokens[t].kind != TK_END; t++)
+        {
+          const Token &tok = ts.tokens[t], &arg = ts.tokens[t+1];
+          if (tok.kind != TK_MNEMONIC || (fastJump(tok.value) < 0 && !isFastJump(tok.value)) || arg.nterms != 1) continue;
+          const Term& term = ts.terms[arg.term];
+          int k = term.type == Term::LABEL ? labels.Find(src.substr(term.pos, term.len)) : -1;
+          if (k != -1 && labels.Value(k) < t) { depth[labels.Value(k)]++; depth[t+1]--; }
+        }
+        for (size_t t=1; t<depth.size(); t++) depth[t] += depth[t-1];
+      }
+      for (int t=0; ts.tokens[t].kind != TK_END; t++) // references
+        visit(src, ts, t, [&](int slot, int type, int v, int)
+        {
+          vars[v].refs++; vars[v].weight += 1LL << (3 * std::min(depth[t], 4));
+          if (type == 2 && variant(ts.tokens[t].value, ARGS[ts.tokens[t].value] ^ (1 << 4*slot)) == -1) vars[v].ispinned = true;
+        });
+
+      std::vector<int> isfree(0x100, 0); // zero-page bytes
+      for (int a=zpfirst; a<=zplast; a++) isfree[a] = !used[a];
+      isvar.assign(symbols.Size(), 0);
+      for (const Var& var : vars) isvar[var.sym] = 1;
+      for (int k=0; k<symbols.Size(); k++) if (!isvar[k] && symbols.Value(k) >= 0 && symbols.Value(k) < 0x100) isfree[symbols.Value(k)] = 0;
+      order.resize(vars.size());
+      for (size_t v=0; v<vars.size(); v++) order[v] = v;
+      std::stable_sort(order.begin(), order.end(), [this](int a, int b)
+        { return vars[a].ispinned != vars[b].ispinned ? vars[a].ispinned : vars[a].weight > vars[b].weight; });
+      for (int v : order)
+      {
+        Var& var = vars[v];
+        int a = zpfirst, last = zplast - var.size + 1;
+        for (; a <= last; a++) if (std::all_of(isfree.begin() + a, isfree.begin() + a + var.size, [](int f) { return f; })) break;
+        if (a <= last) { var.addr = a; std::fill(isfree.begin() + a, isfree.begin() + a + var.size, 0); }
+        else if (var.ispinned)
+          { diag.Error(var.pos, "No room in the zero page for \'" + std::string(var.name) + "\' (used by a zero-page instruction)."); return false; }
+      }
+      isplanned = true;
+
+      for (int t=0; ts.tokens[t].kind != TK_END; t++) // the matching forms
+      {
+        int op = ts.tokens[t].value, want = ARGS[op], up = ARGS[op]; // up: only zero page -> absolute
+        visit(src, ts, t, [&](int slot, int /*type*/, int v, int offset)
+        {
+          const Var& var = vars[v];
+          bool iszp = var.addr >= 0 && offset >= 0 && var.addr + offset + FAMILIES.width[FAMILIES.of[op]] <= 0x100;
+          want = (want & ~(0x0f << 4*slot)) | (iszp ? 2 : 3) << 4*slot;
+          if (!iszp) up = (up & ~(0x0f << 4*slot)) | 3 << 4*slot;
+        });
+        if (want == ARGS[op]) continue;
+        int to = variant(op, want);
+        if (to == -1 && up != ARGS[op] && (to = variant(op, up)) == -1)
+          { diag.Error(ts.tokens[t].pos, "No form of this instruction fits the addresses of its variables."); return false; }
+        if (to == -1) continue;
+        if (rewrites.empty()) rewrites.assign(ts.tokens.size(), -1);
+        rewrites[t] = to;
+      }
+      return true;
+    }
+    // Defines the addresses of the variables at the end of pass 1, false: errors
+    bool Place(SymbolTable& symbols, Diagnostics& diag)
+    {
+      if (!isplanned) return true;
+      int addr = data != -1 ? data : top;
+      for (Var& var : vars)
+      {
+        if (var.addr >= 0 && var.addr < 0x100)
+        {
+          if (std::any_of(used.begin() + var.addr, used.begin() + var.addr + var.size, [](int u) { return u; }))
+            { diag.Error(var.pos, "Variable \'" + std::string(var.name) + "\' overlaps bytes placed in the zero page."); return false; }
+        }
+        else
+        {
+          if (addr < 0x100 || addr + var.size > 0x10000)
+            { diag.Error(var.pos, "No address for \'" + std::string(var.name) + "\', use \'#data 0x....\'."); return false; }
+          var.addr = addr; addr += var.size;
+        }
+        symbols.SetValue(var.sym, var.addr);
+      }
+      return true;
+    }
+    void Report(Diagnostics& diag) const // allocation map
+    {
+      int zp = 0, bytes = 0;
+      for (const Var& var : vars) { zp += var.addr < 0x100; bytes += var.addr < 0x100 ? var.size : 0; }
+      diag.Note("Allocated " + std::to_string(vars.size()) + " variables, " + std::to_string(zp) + " of them (" +
+                std::to_string(bytes) + " bytes) in the zero page.");
+      std::vector<const Var*> map;
+      for (const Var& var : vars) map.push_back(&var);
+      std::stable_sort(map.begin(), map.end(), [](const Var* a, const Var* b) { return a->addr < b->addr; });
+      char line[160];
+      for (const Var* var : map)
+      {
+        snprintf(line, sizeof(line), "0x%04x %.*s: %d byte%s, %d references, weight %lld%s", var->addr, int(var->name.size()),
+                 var->name.data(), var->size, var->size == 1 ? "" : "s", var->refs, var->weight, var->ispinned ? ", pinned" : "");
+        diag.Note(line);
+      }
+    }
+  protected:
+    struct Var { std::string_view name; int pos, size, sym, refs; long long weight; int addr; bool ispinned; };
+    std::vector<Var> vars; // in order of declaration
+    size_t n = 0; // declared by this pass 1
+    int mark = 0, top = 0, zpfirst = 0x00, zplast = 0x7f, data = -1;
+    std::vector<int> used; // per zero-page byte: placed by this pass 1
+    bool isplanned = false;
+    SymbolTable names, labels; // variable and label definition token by name
+    std::vector<int> depth, order;
+    std::vector<uint8_t> isvar;
+
+    static int variant(int op, int args) // the op code of its family with these arguments, -1: none
+    {
+      for (int x=0; x<256; x++) if (FAMILIES.of[x] == FAMILIES.of[op] && ARGS[x] == args) return x;
+      return -1;
+    }
+    static bool isAddress(int op, int slot) // is the operand in a zero-page or an absolute form?
+    {
+      for (int x=0; x<256; x++) if (FAMILIES.of[x] == FAMILIES.of[op] && ((ARGS[x] ^ ARGS[op]) >> 4*slot & 0x0f)) return true;
+      return false;
+    }
+    // Calls f(slot, type, variable, offset) for the operands of the instruction at t that address a variable (in a
+    // zero-page slot or one that has a zero-page form)
+    template<class F> void visit(std::string_view src, const TokenStream& ts, int t, F f) const
+    {
+      const Token& tok = ts.tokens[t];
+      if (tok.kind != TK_MNEMONIC) return;
+      int e = t + 1;
+      for (int slot=0, x = ARGS[tok.value]; x; slot++, x >>= 4)
+      {
+        const Token& arg = ts.tokens[e];
+        if (arg.kind != TK_NUMBER && arg.kind != TK_EXPR) return;
+        bool isword = (arg.flags & TF_WORD) && !(arg.flags & (TF_LSB | TF_MSB));
+        e += (x & 0x0f) == 3 && !isword ? 2 : 1; // LSB and MSB
+        if (arg.nterms != 1 || !isword || ts.terms[arg.term].type != Term::LABEL || ts.terms[arg.term].sign != 1) continue;
+        if ((x & 0x0f) != 2 && !isAddress(tok.value, slot)) continue; // e.g. the address of a variable as a word
+        int v = names.Find(src.substr(ts.terms[arg.term].pos, ts.terms[arg.term].len));
+        if (v != -1) f(slot, x & 0x0f, names.Value(v), arg.value);
+      }
+    }
+};
+
+// Reachability of the blocks of the program (Options::strip). A block runs from a label, '#org', '#mute' or '#emit' to
+// the next one. The first block after each '#org', the entries of a jump table there (blocks of a single JPA) and the
+// blocks of '#entry label' are reached. A reached block reaches the blocks of the labels it refers to (label+offset,
+// also with '<' or '>': the block of that address) and the next block unless its last instruction is JPA, JPR, FPA or
+// RTS. A block of data reaches the blocks of data that follow it, since tables are indexed at run time. The unreached
+// blocks are left out, muted ones are kept.
+class Stripper
+{
+  public:
+    void Rewind(int tokens) { pcs.resize(tokens); } // pass 1 starts
+    void Mark(int t, int pc) { pcs[t] = pc; } // pass 1 is at token t (and at TK_END)
+    // Leaves the unreached blocks out (DROP), returns their number
+    int Run(std::string_view src, const TokenStream& ts, const SymbolTable& symbols, std::vector<int16_t>& rewrites)
+    {
+      constexpr int JPA = opIndex("JPA"), JPR = opIndex("JPR"), FPA = opIndex("FPA"), RTS = opIndex("RTS");
+      int end = ts.tokens.size() - 1;
+      blocks.assign(1, { 0, 0, end, -1, false, true, false, true, false, false, 0 }); // before the first label
+      blockof.assign(symbols.Size(), -1);
+      bool isemit = true;
+      for (int t=0; t<end; t++) // the blocks
+      {
+        const Token& tok = ts.tokens[t];
+        bool isorg = tok.kind == TK_DIRECTIVE && (tok.value == DIR_ORG || tok.value == DIR_MUTE || tok.value == DIR_EMIT);
+        if (!isorg && !isLabel(ts, t)) { if (tok.kind == TK_DIRECTIVE) t += argsOf(ts, t); continue; }
+        if (isorg && tok.value != DIR_ORG) isemit = tok.value == DIR_EMIT;
+        int begin = isorg ? t + 1 + argsOf(ts, t) : t, k = isorg ? -1 : symbols.Find(src.substr(tok.pos, tok.len-1));
+        blocks.back().last = t;
+        blocks.push_back({ t, begin, end, k, !isemit, isorg && tok.value != DIR_MUTE, false, true, false, false, 0 });
+        if (k != -1) blockof[k] = blocks.size() - 1;
+        if (isorg) t = begin - 1;
+      }
+      edges.clear();
+      for (size_t b=0; b<blocks.size(); b++) // what each block refers to, how it ends
+      {
+        Block& block = blocks[b];
+        block.edge = edges.size();
+        block.size = block.ismuted ? 0 : pcs[block.last] - pcs[block.begin];
+        int last = -1, ops = 0; // op code of the last instruction, number of instructions
+        bool isfirst = true;
+        for (int t=block.begin; t<block.last; t++)
+        {
+          const Token& tok = ts.tokens[t];
+          if (tok.kind == TK_DIRECTIVE && tok.value == DIR_ENTRY) // a label that is reached from outside
+          {
+            int k = symbols.Find(src.substr(ts.tokens[t+1].pos, ts.tokens[t+1].len));
+            if (k != -1 && blockof[k] != -1) blocks[blockof[k]].isroot = true;
+          }
+          if (tok.kind == TK_DIRECTIVE && tok.value != DIR_BYTES && tok.value != DIR_WORDS) { t += argsOf(ts, t); continue; }
+          if (tok.kind == TK_LABEL) continue; // its own
+          if (isfirst) { block.isdata = tok.kind != TK_MNEMONIC; isfirst = false; }
+          if (tok.kind == TK_MNEMONIC) { last = !rewrites.empty() && rewrites[t] >= 0 ? rewrites[t] : tok.value; ops++; }
+          for (int i=tok.term; i<tok.term+tok.nterms; i++)
+          {
+            const Term& term = ts.terms[i];
+            int k = term.type == Term::LABEL ? symbols.Find(src.substr(term.pos, term.len)) : -1;
+            if (k == -1 || blockof[k] == -1) continue;
+            int to = blockof[k];
+            if (tok.nterms == 1 && !(tok.flags & TF_RPN) && term.sign == 1 && tok.value != 0) // the block of label+offset
+            {
+              int addr = symbols.Value(k) + tok.value;
+              while (to+1 < int(blocks.size()) && blocks[to+1].sym != -1 && pcs[blocks[to+1].begin] <= addr) to++;
+              while (to > 0 && blocks[to].sym != -1 && addr < pcs[blocks[to].begin]) to--; // not beyond its segment
+            }
+            edges.push_back(to);
+          }
+        }
+        block.isfalling = last == -1 ? !block.isdata : last != JPA && last != JPR && last != FPA && last != RTS;
+        block.isjump = ops == 1 && last == JPA && !block.isdata;
+      }
+      for (size_t b=0; b+1<blocks.size(); b++) // the entries of a jump table after '#org'
+        if (blocks[b].isroot && (blocks[b].isjump || blocks[b].begin == blocks[b].last) && blocks[b+1].sym != -1)
+          blocks[b+1].isroot = true;
+      for (Block& block : blocks) block.isreached = false;
+      std::vector<int> queue;
+      auto reach = [&](int b) { if (!blocks[b].isreached) { blocks[b].isreached = true; queue.push_back(b); } };
+      for (size_t b=0; b<blocks.size(); b++) if (blocks[b].isroot || blocks[b].ismuted) reach(b);
+      while (!queue.empty())
+      {
+        int b = queue.back(); queue.pop_back();
+        const Block& block = blocks[b];
+        int last = b+1 < int(blocks.size()) ? blocks[b+1].edge : edges.size();
+        for (int e=block.edge; e<last; e++) reach(edges[e]);
+        if (b+1 == int(blocks.size()) || blocks[b+1].sym == -1) continue; // the next one starts a segment
+        if (block.isfalling || (block.isdata && (blocks[b+1].isdata || blocks[b+1].begin + 1 == blocks[b+1].last))) reach(b+1);
+      }
+      int n = 0;
+      for (const Block& block : blocks)
+      {
+        if (block.isreached || block.size == 0) continue;
+        if (rewrites.empty()) rewrites.assign(ts.tokens.size(), -1);
+        for (int t=block.first; t<block.last; t++) // the directives of settings stay
+        {
+          const Token& tok = ts.tokens[t];
+          if (tok.kind == TK_DIRECTIVE && tok.value != DIR_BYTES && tok.value != DIR_WORDS) t += argsOf(ts, t);
+          else rewrites[t] = DROP;
+        }
+        n++;
+      }
+      return n;
+    }
+    // Reports the size of every block, the largest first
+    void Report(std::string_view src, const TokenStream& ts, Diagnostics& diag) const
+    {
+      std::vector<const Block*> list;
+      int n = 0, bytes = 0, total = 0;
+      for (const Block& block : blocks)
+        if (block.size > 0)
+        {
+          list.push_back(&block); total += block.size;
+          if (!block.isreached) { n++; bytes += block.size; }
+        }
+      diag.Note("Stripped " + std::to_string(n) + " of " + std::to_string(list.size()) + " blocks, " + std::to_string(bytes) +
+                " of " + std::to_string(total) + " bytes.");
+      std::stable_sort(list.begin(), list.end(), [](const Block* a, const Block* b) { return a->size > b->size; });
+      char line[200];
+      for (const Block* block : list)
+      {
+        const Token& tok = ts.tokens[block->first];
+        std::string_view name = tok.kind == TK_LABEL ? src.substr(tok.pos, tok.len-1)
+                              : tok.kind == TK_DIRECTIVE ? src.substr(tok.pos, tok.len) : "(start)";
+        snprintf(line, sizeof(line), "%6d byte%s %s: %.*s%s", block->size, block->size == 1 ? "  " : "s ", diag.Where(tok.pos).c_str(),
+                 int(name.size()), name.data(), block->isreached ? "" : " (stripped)");
+        diag.Note(line);
+      }
+    }
+  protected:
+    struct Block
+    {
+      int first, begin, last; // tokens: the label (or directive), the first of its content, the next block
+      int sym; // symbol of the label, -1: none
+      bool ismuted, isroot, isdata, isfalling, isjump, isreached; // isdata: starts with data, isfalling: into the next
+                                                                  // block, isjump: a single JPA
+      int size, edge = 0; // edge: its first entry in 'edges'
+    };
+    std::vector<Block> blocks; // in source order
+    std::vector<int> blockof; // per symbol
+    std::vector<int> edges; // blocks referred to, per block
+    std::vector<int> pcs; // per token: pc of pass 1
+    static int argsOf(const TokenStream& ts, int t) // the arguments of the directive at t (as pass 1 takes them)
+    {
+      auto isaddr = [&](int i) { return ts.tokens[t+i].kind < TK_INVALID && (ts.tokens[t+i].flags & TF_HEXWORD); };
+      switch (ts.tokens[t].value)
+      {
+        case DIR_ORG: case DIR_DATA: return isaddr(1);
+        case DIR_ZP: return isaddr(1) && isaddr(2) ? 2 : 0;
+        case DIR_VAR: return ts.tokens[t+1].kind != TK_LABEL ? 0 : ts.tokens[t+2].kind == TK_NUMBER ? 2 : 1;
+        case DIR_ENTRY: return ts.tokens[t+1].kind == TK_EXPR;
+        case DIR_BYTES: case DIR_WORDS: { Table table; return table.Read(ts, t) ? 0 : 4; }
+      }
+      return 0;
+    }
+};
+
+struct Workspace // memory of an assembly that is kept for the next one: after warm-up nothing is allocated
+{
+  TokenStream ts, all; // tokens of the source, with the included files
+  TokenStream lexed, scratch; // tokens of 'text' kept up to date by AsmContext::Update()
+  std::string text; // source of the last AsmContext::Update()
+  std::string textpath;
+  bool islexed = false; // the next assembly takes the tokens of 'lexed'
+  std::unique_ptr<Preprocessor> pre; // holds the source together with the included files, the symbols refer to it
+  SymbolTable symbols;
+  std::vector<int> cuts;
+  std::vector<Layout> layout; // Options::relax
+  std::vector<uint8_t> relaxed; // per token: 1 = a jump in its fast form
+  Freezer freezer; // Options::relax
+  Optimizer optimizer; // Options::optimize
+  Allocator allocator; // '#var'
+  Stripper stripper; // Options::strip
+  std::vector<int16_t> rewrites; // per token: see DROP
+  std::unique_ptr<Printer> printers[4]; // one per output format
+  Printer& GetPrinter(const Options& opt, std::string& out)
+  {
+    std::unique_ptr<Printer>& printer = printers[opt.format];
+    if (printer) printer->Reset(out, opt); else printer = makePrinter(opt, out);
+    return *printer;
+  }
+};
+
+// Assembles the source into hexout. Errors are collected in diag: By default assembling stops at the first one,
+// in 'collect all' mode the assembler records it, assumes the expected element size and carries on.
+// Included files are searched relative to 'path'.
+void Assembler(Workspace& ws, std::string_view src, std::string& out, Diagnostics& diag, const Options& opt,
+               std::string_view path = "", Products* products = nullptr)
+{
+  SymbolTable& symbols = ws.symbols; // all label definitions with ":" and their addresses
+  Printer& hex = ws.GetPrinter(opt, out); // contains an "emission counter", use HEX.GetAddress()
+  bool isemit = true; // default true
+  bool isop, isword, islsb, ismsb; // expression result flags
+  int lsb, msb; // expression result
+  int args = 0; // "expect" arguments nibble pipeline
+  int pc = 0; // program counter keeping track of target location
+  int t = 0; // token index
+  std::vector<int>& cuts = ws.cuts; // tokens of '#org' while emitting without pending arguments: pass 2 may start here
+  std::vector<Layout>& layout = ws.layout; // Options::relax
+  std::vector<uint8_t>& relaxed = ws.relaxed;
+  std::vector<int16_t>& rewrites = ws.rewrites; // Options::optimize
+  auto fail = [&](const Token& tok, const char* msg) { diag.Error(tok.pos, msg); return diag.Stop(); }; // true: abort
+
+  Stats* stats = opt.stats && products ? &products->stats : nullptr; // off: nothing is recorded
+  if (stats) stats->Start();
+  rewrites.clear(); relaxed.clear(); ws.allocator.Reset(); ws.pre.reset();
+  const TokenStream* lexed = &ws.lexed; // the source is lexed only once
+  if (!ws.islexed) { ws.ts.tokens.clear(); ws.ts.terms.clear(); Tokenize(src, ws.ts); lexed = &ws.ts; }
+  ws.islexed = false;
+  std::unique_ptr<Preprocessor>& pre = ws.pre;
+  if (std::any_of(lexed->tokens.begin(), lexed->tokens.end(), [](const Token& tok)
+    { return tok.kind == TK_DIRECTIVE && (tok.value == DIR_INCLUDE || tok.value == DIR_IMPORT || (tok.value >= DIR_MACRO && tok.value <= DIR_ENDR)); }))
+  {
+    ws.all.tokens.clear(); ws.all.terms.clear();
+    pre = std::make_unique<Preprocessor>(src, path, diag, opt.listing);
+    if (!pre->Expand(*lexed, ws.all)) return;
+    lexed = &ws.all; src = pre->Text();
+    if (products) products->includes = pre->Files();
+  }
+  const TokenStream& ts = *lexed;
+  if (stats) stats->Stop(Stats::LEX);
+
+// ******************
+// ***** PASS 1 *****
+// ******************
+  // Defines the labels, returns false on abort. Runs again if the optimizer rewrote instructions.
+  auto pass1 = [&]() -> bool
+  {
+    symbols.Clear(); cuts.clear(); layout.clear(); ws.allocator.Rewind();
+    if (opt.strip) ws.stripper.Rewind(ts.tokens.size());
+    isemit = true; args = 0; pc = 0;
+    for (t = 0; ts.tokens[t].kind != TK_END; t++) // any element to process?
+    {
+      const Token& tok = ts.tokens[t];
+      if (opt.strip) ws.stripper.Mark(t, pc);
+      if (!rewrites.empty() && rewrites[t] == DROP) continue; // Options::optimize
+      if (tok.kind == TK_INVALID) { if (fail(tok, "Invalid element.")) return false; }
+      else if (tok.kind == TK_LABEL) // label definition
+      {
+        std::string_view def = src.substr(tok.pos, tok.len-1);
+        int k = symbols.Insert(def, pc);
+        if (k == -1) // accept as new definition
+        {
+          symbols.Poison(symbols.Find(def)); // its address is ambiguous now
+          if (fail(tok, "Definition already exists.")) return false;
+        }
+        else if (opt.relax) layout.push_back({ Layout::LABEL, pc, k, pc });
+      }
+      else if (tok.kind == TK_DIRECTIVE) // preprocessor command (ignore any #... but #org in pass 1)
+      {
+        if (stats && tok.value <= DIR_EMIT) stats->Emitted(pc, isemit); // bytes of the segment so far
+        if (tok.value <= DIR_EMIT) ws.allocator.Placed(pc, isemit);
+        if (tok.value == DIR_MUTE) isemit = false;
+        else if (tok.value == DIR_EMIT) isemit = true;
+        else if (tok.value == DIR_ORG)
+        {
+          if (isemit && args == 0) cuts.push_back(t);
+          const Token& arg = ts.tokens[++t]; // consume '#org' element and look for next element '0x....'
+          if (arg.kind < TK_INVALID && (arg.flags & TF_HEXWORD))
+          {
+            pc = arg.value; ws.allocator.Moved(pc);
+            if (stats) stats->Org(pc, isemit);
+            if (opt.relax) layout.push_back({ Layout::ORG, pc, 0, pc });
+          }
+          else { if (fail(arg, "Expecting a 16-bit HEX address.")) return false; t--; } // don't consume a non-address
+        }
+        else if (tok.value == DIR_PAGE)
+        {
+          if (opt.relax) layout.push_back({ Layout::PAGE, pc, 0, pc });
+          int delta = (-(pc & 0xff)) & 0xff;
+          pc += delta; ws.allocator.Moved(pc);
+          if (stats) stats->Emitted(pc, false); // skipped, not emitted
+        }
+        else if (tok.value == DIR_VAR) // '#var name: [size]', the allocator defines its address
+        {
+          const Token& def = ts.tokens[t+1];
+          if (def.kind != TK_LABEL) { if (fail(def, "Expecting a variable name like \'name:\'.")) return false; continue; }
+          int size = 1;
+          if (ts.tokens[++t + 1].kind == TK_NUMBER)
+          {
+            size = ts.tokens[++t].value;
+            if (size < 1 || size > 0x8000) { if (fail(ts.tokens[t], "Invalid variable size.")) return false; size = 1; }
+          }
+          std::string_view name = src.substr(def.pos, def.len-1);
+          int k = symbols.Insert(name, 0);
+          if (k == -1) { symbols.Poison(symbols.Find(name)); if (fail(def, "Definition already exists.")) return false; }
+          else ws.allocator.Declare(name, size, def.pos, k);
+        }
+        else if (tok.value == DIR_ENTRY) // '#entry label' for Options::strip, checked by pass 2
+        {
+          const Token& arg = ts.tokens[t+1];
+          if (arg.kind != TK_EXPR || arg.nterms != 1 || arg.value != 0 || arg.flags != TF_WORD || ts.terms[arg.term].len != arg.len)
+            { if (fail(tok, "Expecting a label name.")) return false; }
+          else t++;
+        }
+        else if (tok.value == DIR_BYTES || tok.value == DIR_WORDS) // a table, pass 2 computes its values
+        {
+          Table table;
+          if (const char* err = table.Read(ts, t)) { if (fail(tok, err)) return false; continue; }
+          pc += table.Size(); t += 4;
+        }
+        else if (tok.value == DIR_ZP || tok.value == DIR_DATA) // settings of the allocator
+        {
+          const Token &first = ts.tokens[t+1], &last = ts.tokens[t+2];
+          auto isaddr = [](const Token& arg) { return arg.kind < TK_INVALID && (arg.flags & TF_HEXWORD); };
+          if (tok.value == DIR_DATA)
+          {
+            if (isaddr(first)) { ws.allocator.Data(first.value); t++; }
+            else if (fail(first, "Expecting a 16-bit HEX address.")) return false;
+          }
+          else if (isaddr(first) && isaddr(last) && first.value <= last.value && last.value < 0x100)
+            { ws.allocator.ZeroPage(first.value, last.value); t += 2; }
+          else if (fail(first, "Expecting a zero-page range like 0x0000 0x007f.")) return false;
+        }
+        else if (tok.value == DIR_IMPORT) // define the symbols of a symbol file without any lexing
+        {
+          const Preprocessor::Import& imp = pre->GetImport(tok);
+          for (auto [e, last] = imp.symbols->Prefix(imp.tag); e < last; e++)
+            if (symbols.Insert(imp.symbols->Name(*e), e->value, e->hash) == -1)
+            {
+              symbols.Poison(symbols.Find(imp.symbols->Name(*e)));
+              diag.Error(tok.pos, "Imported definition \'" + std::string(imp.symbols->Name(*e)) + "\' already exists.");
+              if (diag.Stop()) return false;
+            }
+        }
+      }
+      else // PARSE MODE-SPECIFICALLY
+      {
+        switch (args & 0x0f) // handle different expectation modes
+        {
+          case 0: // no expectations
+          {
+            if (tok.kind == TK_STRING) pc += tok.len-2; // pure 'string' or "string"
+            else if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, false, lsb, msb, hex))
+              { if (diag.Stop()) return false; pc++; }
+            else if (isop) // instruction-specific arguments
+            {
+              if (!rewrites.empty() && rewrites[t] >= 0) lsb = rewrites[t]; // Options::optimize
+              if ((opt.relax || opt.optimize) && (fastJump(lsb) >= 0 || isFastJump(lsb))) layout.push_back({ Layout::JUMP, pc, t, pc });
+              args = ARGS[lsb]; pc++;
+            }
+            else if (isword && !islsb && !ismsb) pc+=2;
+            else pc++;
+            break;
+          }
+          case 1: // expect a byte argument
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, false, lsb, msb, hex))
+              { if (diag.Stop()) return false; }
+            else if (isop || (isword && !islsb && !ismsb)) { if (fail(tok, "Expecting a byte argument.")) return false; }
+            pc++; args >>= 4;
+            break;
+          }
+          case 2: // expect zero-page argument
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, false, lsb, msb, hex))
+              { if (diag.Stop()) return false; }
+            else if (isop || ismsb) { if (fail(tok, "Expecting a zero-page argument.")) return false; }
+            pc++; args >>= 4;
+            break;
+          }
+          case 3: // expect a word argument (may be LSB followed by MSB, too)
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, false, lsb, msb, hex))
+              { if (diag.Stop()) return false; pc+=2; args >>= 4; }
+            else if (isop) { if (fail(tok, "Expecting a word argument.")) return false; pc+=2; args >>= 4; }
+            else if (isword && !islsb && !ismsb) { pc+=2; args >>= 4; }
+            else { pc++; args = (args & 0xf0) | 0x01; } // change expectation to byte (trailing MSB)
+            break;
+          }
+          case 4: // expect a fast jump argument
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, false, lsb, msb, hex))
+              { if (diag.Stop()) return false; }
+            else if (isop || ismsb) { if (fail(tok, "Invalid fast jump.")) return false; }
+            pc++; args >>= 4;
+            break;
+          }
+        }
+      }
+    }
+    if (stats) stats->Emitted(pc, isemit);
+    if (opt.strip) ws.stripper.Mark(t, pc);
+    ws.allocator.Placed(pc, isemit);
+    return ws.allocator.Place(symbols, diag) || !diag.Stop();
+  };
+  if (!pass1()) return;
+
+  if (!ws.allocator.IsEmpty() && diag.Count() == 0) // pass 1 again with the variables at their addresses
+  {
+    if (!ws.allocator.Plan(src, ts, symbols, opt.loopweight, rewrites, diag)) return;
+    if (stats) stats->Restart();
+    if (!pass1()) return;
+  }
+
+  if (opt.strip && diag.Count() == 0) // pass 1 again without the blocks nothing reaches
+  {
+    if (ws.stripper.Run(src, ts, symbols, rewrites) > 0)
+    {
+      if (stats) stats->Restart();
+      if (!pass1()) return;
+    }
+    ws.stripper.Report(src, ts, diag);
+  }
+
+  if (opt.optimize && diag.Count() == 0) // pass 1 again with the rewrites until they keep the fast jumps intact
+  {
+    ws.optimizer.Guard(src, ts, symbols, layout);
+    if (ws.optimizer.Run(src, ts, symbols, rewrites) > 0)
+      for (bool isvalid = false; !isvalid;)
+      {
+        if (stats) stats->Restart();
+        if (!pass1()) return;
+        isvalid = ws.optimizer.Verify(src, ts, symbols, layout, rewrites);
+      }
+    ws.optimizer.Report(src, ts, rewrites, diag);
+  }
+  if (!ws.allocator.IsEmpty() && diag.Count() == 0) ws.allocator.Report(diag);
+  if (stats) stats->Stop(Stats::PASS1);
+
+  if (opt.relax && diag.Count() == 0) // pass 2 emits the fast form of the jumps marked in 'relaxed'
+  {
+    int jumps = std::count_if(layout.begin(), layout.end(),
+      [&](const Layout& e) { return e.kind == Layout::JUMP && !isFastJump(ts.tokens[e.ref].value); });
+    int fast = relaxJumps(src, ts, layout, symbols, relaxed, ws.freezer);
+    diag.Note("Relaxed " + std::to_string(fast) + " of " + std::to_string(jumps) + " jumps, " + std::to_string(fast) + " bytes saved.");
+    for (const Layout& e : layout)
+      if (e.kind == Layout::JUMP && relaxed[e.ref] == 1)
+      {
+        const Token& tok = ts.tokens[e.ref];
+        diag.Note(diag.Where(tok.pos) + ": " + std::string(src.substr(tok.pos, tok.len)) + " -> " + MNEMONICS[fastJump(tok.value)]);
+      }
+  }
+
+  if (opt.doexport && products && diag.Count() == 0) // the sources it was made of detect a stale symbol file
+  {
+    std::error_code ec;
+    std::vector<std::string> sources { std::filesystem::weakly_canonical(std::filesystem::path(path), ec).string() };
+    if (pre) for (const std::string& p : pre->Files()) sources.push_back(p);
+    products->symbols = SymbolFile::Write(symbols, sources);
+  }
+
+  // ***********************************************************
+  // ***** output symbolic constants [starting with 'tag'] *****
+  // ***********************************************************
+  if (opt.dosym)
+  {
+    for(int k=0; k<symbols.Size(); k++) // scan all labels in order of definition for the prefix
+    {
+      int adr = symbols.Value(k);
+      if (symbols.Name(k).substr(0, opt.symtag.length()) == opt.symtag)
+      {
+        out += "#org 0x"; out.append(HEXTABLE.lower[(adr >> 8) & 0xff], 2); out.append(HEXTABLE.lower[adr & 0xff], 2);
+        out += ' '; out += symbols.Name(k); out += ":\n";
+      }
+    }
+    if (stats) { stats->Stop(Stats::SYMBOLS); stats->Collect(ts, symbols); }
+    return;
+  }
+  if (stats) stats->Stop(Stats::SYMBOLS);
+
+  // ******************
+  // ***** PASS 2 *****
+  // ******************
+  // Pass 2 of the tokens t..end-1 into 'hex' starting with pending arguments 'args', returns false on abort.
+  // It only reads the symbol table (unless errors are collected), so parts of the source can run concurrently.
+  auto pass2 = [&](int t, int end, Printer& hex, Diagnostics& diag, int& args) -> bool
+  {
+    bool isemit = true; // default true
+    bool isop, isword, islsb, ismsb; // expression result flags
+    int lsb, msb; // expression result
+    int pc = 0; // use pc for fast-jump check
+    auto fail = [&](const Token& tok, const char* msg) { diag.Error(tok.pos, msg); return diag.Stop(); };
+
+    for (; t < end; t++) // any element to process?
+    {
+      const Token& tok = ts.tokens[t];
+      if (!rewrites.empty() && rewrites[t] == DROP) continue; // Options::optimize
+      if (tok.kind == TK_INVALID || tok.kind == TK_LABEL); // reported in pass 1, ignore label definitions in pass 2
+      else if (tok.kind == TK_DIRECTIVE) // handle all preprocessor commands
+      {
+        switch (tok.value)
+        {
+          case DIR_MUTE: isemit = false; break;
+          case DIR_EMIT: isemit = true; break;
+          case DIR_ONCE: case DIR_IMPORT: break; // only meaningful in included files, handled by pass 1
+          case DIR_VAR: // '#var name: [size]', defined by pass 1
+            if (ts.tokens[t+1].kind == TK_LABEL && ts.tokens[++t + 1].kind == TK_NUMBER) t++;
+            break;
+          case DIR_ZP: case DIR_DATA: // settings of the allocator, checked by pass 1
+            for (int n = tok.value == DIR_ZP ? 2 : 1; n > 0 && ts.tokens[t+1].kind < TK_INVALID && (ts.tokens[t+1].flags & TF_HEXWORD); n--) t++;
+            break;
+          case DIR_ENTRY: // '#entry label', checked by pass 1
+          {
+            const Token& arg = ts.tokens[t+1];
+            if (arg.kind != TK_EXPR) break;
+            std::string_view name = src.substr(arg.pos, arg.len);
+            if (symbols.Find(name) == -1) { diag.Error(arg.pos, "Unknown reference \'" + std::string(name) + "\'."); if (diag.Stop()) return false; }
+            t++;
+            break;
+          }
+          case DIR_BYTES: case DIR_WORDS:
+          {
+            Table table;
+            if (table.Read(ts, t)) break; // reported by pass 1 (unless errors are being collected)
+            if (!table.Emit(src, ts, symbols, diag, hex, isemit) && diag.Stop()) return false;
+            pc += table.Size(); t += 4;
+            break;
+          }
+          case DIR_PAGE:
+          {
+            int delta = (-(pc & 0xff)) & 0xff;
+            pc += delta;
+            if (isemit) hex.SetAddress(hex.GetAddress() + delta);
+            break;
+          }
+          case DIR_ORG:
+          {
+            const Token& arg = ts.tokens[++t]; // this #org 0x. is already known to be parsable from pass 1
+            if (!(arg.flags & TF_HEXWORD)) { t--; break; } // (unless errors are being collected)
+            pc = arg.value; // always set pc...
+            if (isemit) hex.SetAddress(pc); // ... but set mc only while emitting
+            break;
+          }
+          default: { if (fail(tok, "Unknown pre-proc command.")) return false; }
+        }
+      }
+      else // parse mode-specifically
+      {
+        switch (args & 0x0f) // handle different expectation modes
+        {
+          case 0: // expect anything (including strings, opcodes, constants)
+          {
+            if (tok.kind == TK_STRING && tok.len > 3) // string, but not a single char
+              for (int i=tok.pos+1; i<tok.pos+tok.len-1; i++) { pc++; if (isemit) hex.Emit(src[i]); }
+            else // expression (may include single chars, mnemonics, ...)
+            {
+              if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, true, lsb, msb, hex))
+                { if (diag.Stop()) return false; pc++; }
+              else if (isop) // pure mnemonic allowed here
+              {
+                if (!relaxed.empty() && relaxed[t] == 1) lsb = fastJump(lsb); // Options::relax
+                else if (!rewrites.empty() && rewrites[t] >= 0) lsb = rewrites[t]; // Options::optimize
+                args = ARGS[lsb]; pc++; if (isemit) hex.Emit(lsb);
+              }
+              else if (islsb) { pc++; if (isemit) hex.Emit(lsb); }
+              else if (ismsb) { pc++; if (isemit) hex.Emit(msb); }
+              else if (isword) { pc+=2; if (isemit) { hex.Emit(lsb); hex.Emit(msb); } } // ... but not islsb or ismsb
+              else
+              {
+                if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; if (isemit) hex.Emit(lsb); }
+                else
+                {
+                  diag.Error(tok.pos, "Expression size unclear.", ", lsb=" + std::to_string(lsb) + ", msb=" + std::to_string(msb));
+                  if (diag.Stop()) return false;
+                  pc++;
+                }
+              }
+            }
+            break;
+          }
+          case 1: // expect byte argument
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, true, lsb, msb, hex))
+              { if (diag.Stop()) return false; pc++; }
+            else if (islsb) { pc++; if (isemit) hex.Emit(lsb); }
+            else if (ismsb) { pc++; if (isemit) hex.Emit(msb); }
+            else if (isop || isword) { if (fail(tok, "Expecting byte expression.")) return false; pc++; }
+            else
+            {
+              if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; if (isemit) hex.Emit(lsb); }
+              else { if (fail(tok, "Expecting byte expression.")) return false; pc++; }
+            }
+            args >>= 4;
+            break;
+          }
+          case 2: // zero page argument
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, true, lsb, msb, hex))
+              { if (diag.Stop()) return false; pc++; }
+            else if (isop || ismsb) { if (fail(tok, "Expecting a zero-page argument.")) return false; pc++; }
+            else if (islsb || msb == 0x00) { pc++; if (isemit) hex.Emit(lsb); }
+            else { if (fail(tok, "Expecting a zero-page argument.")) return false; pc++; }
+            args >>= 4;
+            break;
+          }
+          case 3: // expect word
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, true, lsb, msb, hex))
+              { if (diag.Stop()) return false; pc+=2; args >>= 4; }
+            else if (isop) { if (fail(tok, "Expecting a word argument.")) return false; pc+=2; args >>= 4; } // redundant
+            else if (islsb) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(lsb); }
+            else if (ismsb) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(msb); }
+            else if (isword) { pc+=2; args >>= 4; if (isemit) { hex.Emit(lsb); hex.Emit(msb); } }
+            else if (msb == 0x00 || (msb == 0xff && (lsb & 0x80) == 0x80)) { pc++; args = (args & 0xf0) | 0x01; if (isemit) hex.Emit(lsb); }
+            else { if (fail(tok, "Unclear word argument.")) return false; pc+=2; args >>= 4; }
+            break;
+          }
+          case 4: // expect fast jump
+          {
+            if (!parseExpr(src, ts, tok, diag, symbols, isop, isword, islsb, ismsb, true, lsb, msb, hex))
+              { if (diag.Stop()) return false; }
+            else if (isop || ismsb || (!islsb && msb != ((pc >> 8) & 0xff) && msb != 0x00 ))
+              { if (fail(tok, "Invalid fast jump.")) return false; }
+            else if (isemit) hex.Emit(lsb);
+            pc++; args >>= 4;
+            break;
+          }
+        }
+      }
+    }
+    return true;
+  };
+
+  int end = ts.tokens.size() - 1; // index of TK_END
+  args = 0;
+  bool isdone = false;
+  if (opt.threads > 1 && !diag.IsCollecting() && opt.format != OUT_SEG && end >= 0x10000 && !cuts.empty())
+  {
+    // split the tokens at '#org's into chunks of similar size, each one is assembled by a printer of its own
+    std::vector<int> starts { 0 };
+    int chunks = std::min<int>(cuts.size() + 1, 4 * opt.threads);
+    for (int c : cuts) if (c - starts.back() >= end / chunks) starts.push_back(c);
+    starts.push_back(end);
+    int n = starts.size() - 1;
+    struct Part { std::string out; std::unique_ptr<Printer> printer; std::unique_ptr<Diagnostics> diag; int args = 0; };
+    std::vector<Part> parts(n);
+    ThreadPool pool(opt.threads);
+    for (int i=0; i<n; i++)
+      pool.Add([&, i]
+      {
+        Part& part = parts[i];
+        part.printer = makePrinter(opt, part.out); part.diag = std::make_unique<Diagnostics>(src);
+        pass2(starts[i], starts[i+1], *part.printer, *part.diag, part.args);
+        part.printer->Flush();
+      });
+    pool.Run();
+    isdone = true; // stitch the parts in source order, errors are reported by the serial pass
+    for (Part& part : parts) if (part.diag->Count() > 0) isdone = false;
+    if (isdone) { for (Part& part : parts) hex.Absorb(*part.printer, part.out); args = parts.back().args; }
+  }
+  if (!isdone && !pass2(0, end, hex, diag, args)) return;
+  t = end;
+  if (stats) stats->Stop(Stats::PASS2);
+
+  // check whether all of the lastly expected arguments were received
+  if (args != 0) { fail(ts.tokens[t], "Missing argument."); return; }
+  hex.Finish();
+
+  char note[160];
+  const Image& image = hex.GetImage();
+  for (auto [first, last] : image.Overlaps())
+  {
+    snprintf(note, sizeof(note), "WARNING: 0x%04x..0x%04x was emitted more than once.", first, last);
+    diag.Note(note);
+  }
+  bool isupload = opt.report && (opt.format == OUT_HEX || opt.format == OUT_SREC);
+  auto uploadTime = [&](const char* what) // predict the time of a terminal upload
+  {
+    int lines = std::count(out.begin(), out.end(), '\n');
+    double secs = out.size() * 10.0 / 500000 + lines * 0.010; // 7N2 = 10 bits per char at 500kbps, 10ms per line
+    snprintf(note, sizeof(note), "%s%d lines, %d chars, upload takes %.2fs at 500kbps and 10ms/line.", what, lines, int(out.size()), secs);
+    diag.Note(note);
+  };
+
+  bool ispack = opt.pack && diag.Count() == 0 && image.First() >= 0;
+  for (int a=0; ispack && a<0x100; a++) // the unpacker uses the zero page
+    if (image.IsUsed(a)) { diag.Note("WARNING: Zero-page data can't be packed, the output is not packed."); ispack = false; }
+  if (ispack) // replace the output by the packed image and its unpacker
+  {
+    if (isupload) uploadTime("Plain:  ");
+    std::vector<uint8_t> pack = packImage(image, image.First());
+    Options sub = opt; sub.pack = false; sub.report = false; sub.dosym = false;
+    sub.format = OUT_BIN; sub.binbase = -1; // measure the size of the unpacker and its data
+    std::string stub = makeUnpacker(pack, 0x8000), bin;
+    Diagnostics subdiag(stub, false);
+    Workspace scratch;
+    Assembler(scratch, stub, bin, subdiag, sub);
+    int addr = opt.packaddr >= 0 ? opt.packaddr : findFree(image, bin.size());
+    for (int a=addr; a>=0 && a<addr+int(bin.size()); a++)
+      if (a > 0xffff || image.IsUsed(a)) { addr = -1; break; }
+    if (addr < 0) { diag.Note("WARNING: No free memory for the unpacker, the output is not packed."); if (isupload) uploadTime(""); return; }
+    stub = makeUnpacker(pack, addr);
+    sub.format = opt.format; sub.binbase = opt.binbase;
+    out.clear();
+    Diagnostics packdiag(stub, false);
+    Assembler(scratch, stub, out, packdiag, sub);
+    if (isupload)
+    {
+      uploadTime("Packed: ");
+      int bytes = 0; for (int a=0; a<0x10000; a++) bytes += image.IsUsed(a);
+      snprintf(note, sizeof(note), "%d bytes packed to %d bytes, unpacking takes about %.0fms.", bytes, int(pack.size()), bytes * 40 / 8000.0); // ~40 cycles per byte at 8MHz
+      diag.Note(note);
+    }
+    snprintf(note, sizeof(note), "Start the unpacker with 'run %04x' after the upload.", addr);
+    diag.Note(note);
+  }
+  else if (isupload) uploadTime("");
+  if (isupload && opt.reclen > 19) diag.Note("WARNING: MinOS 'receive' accepts records of up to 19 bytes only.");
+  if (stats) { stats->Stop(Stats::OUTPUT); stats->Collect(ts, symbols); }
+}
+
+class BuildCache // content-addressed store of successful outputs and their notes, evicts the least recently used
+{
+  public:
+    BuildCache(std::string directory, long long capacity) : dir(std::move(directory)), cap(capacity) {}
+    static std::string Key(std::string_view src, const Options& opt, std::string_view path) // everything the output depends on
+    {
+      char flags[128];
+      snprintf(flags, sizeof(flags), "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d", opt.dosym, opt.format, opt.binbase, opt.fill,
+        opt.reclen, opt.mergegap, opt.report, opt.pack, opt.packaddr, opt.doexport, opt.relax, opt.optimize,
+        opt.loopweight, opt.listing, opt.strip);
+      Hash128 h;
+      h.Add(VERSION).Add(hashISA());
+      h.Add(flags).Add(opt.symtag).Add(src);
+      if (src.find("#include") != std::string_view::npos || src.find("#import") != std::string_view::npos) // relative paths
+      {
+        std::error_code ec;
+        h.Add(std::filesystem::weakly_canonical(std::filesystem::path(path).parent_path(), ec).string());
+      }
+      return h.Hex();
+    }
+    bool Load(const std::string& key, std::string& out, Diagnostics& diag, Products& products) // true: hit, all is restored
+    {
+      if (dir.empty()) return false;
+      std::ifstream file(path(key), std::ios::binary);
+      std::string entry((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      size_t p = MAGIC.size();
+      auto get = [&](std::string& s) // reads a length-prefixed string
+      {
+        if (p + 4 > entry.size()) return false;
+        uint32_t len = uint8_t(entry[p]) | uint8_t(entry[p+1]) << 8 | uint8_t(entry[p+2]) << 16 | uint32_t(uint8_t(entry[p+3])) << 24;
+        if (p + 4 + len > entry.size()) return false;
+        s.assign(entry, p + 4, len); p += 4 + len;
+        return true;
+      };
+      std::string notes, deps;
+      bool isvalid = entry.compare(0, MAGIC.size(), MAGIC) == 0 && get(notes) && get(out) && get(products.symbols) && get(deps);
+      for (size_t a = 0, e; isvalid && a < deps.size(); a = e + 1) // "<hash> <path>" of each included file
+      {
+        e = deps.find('\n', a);
+        std::string dep = deps.substr(a, e - a);
+        isvalid = dep.size() > 33 && hashFile(dep.substr(33)) == dep.substr(0, 32);
+      }
+      if (!isvalid) { misses++; out.clear(); products.symbols.clear(); return false; }
+      for (size_t a = 0, e; a < notes.size(); a = e + 1) { e = notes.find('\n', a); diag.Note(notes.substr(a, e - a)); }
+      std::error_code ec; // a hit makes the entry the most recently used one
+      std::filesystem::last_write_time(path(key), std::filesystem::file_time_type::clock::now(), ec);
+      hits++;
+      return true;
+    }
+    void Store(const std::string& key, const std::string& out, const Diagnostics& diag, const Products& products) // atomically
+    {
+      if (dir.empty()) return;
+      std::string notes, deps, entry = MAGIC;
+      for (const std::string& n : diag.Notes()) notes += n + "\n";
+      for (const std::string& path : products.includes) deps += hashFile(path) + " " + path + "\n";
+      auto put = [&](const std::string& s) // writes a length-prefixed string
+      {
+        for (int i=0; i<4; i++) entry += char(uint32_t(s.size()) >> (8*i));
+        entry += s;
+      };
+      put(notes); put(out); put(products.symbols); put(deps);
+      std::error_code ec;
+      std::filesystem::create_directories(dir, ec);
+      std::string tmp = path(key) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()))
+        + std::to_string(Clock::now().time_since_epoch().count());
+      {
+        std::ofstream file(tmp, std::ios::binary);
+        if (!file.write(entry.data(), entry.size())) { file.close(); std::filesystem::remove(tmp, ec); return; }
+      }
+      std::filesystem::rename(tmp, path(key), ec);
+      if (ec) std::filesystem::remove(tmp, ec);
+    }
+    void Evict() // removes the least recently used entries until the cache fits its capacity
+    {
+      if (dir.empty()) return;
+      std::error_code ec;
+      std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+      size = 0;
+      for (const auto& e : std::filesystem::directory_iterator(dir, ec))
+        if (e.path().extension() == ".asmc") { size += e.file_size(ec); files.push_back({ e.last_write_time(ec), e.path() }); }
+      std::sort(files.begin(), files.end());
+      entries = files.size();
+      for (size_t i=0; i<files.size() && size > cap; i++)
+      {
+        size -= std::filesystem::file_size(files[i].second, ec);
+        std::filesystem::remove(files[i].second, ec); entries--;
+      }
+    }
+    void PrintStats(std::ostream& out) // call after Evict()
+    {
+      if (dir.empty()) { out << "Cache: off.\n"; return; }
+      out << "Cache " << dir << ": " << hits << " hits, " << misses << " misses, " << entries << " entries, "
+          << (size + 1023) / 1024 << "KB of " << cap / 1024 << "KB.\n";
+    }
+  protected:
+    using Clock = std::chrono::steady_clock;
+    const std::string MAGIC = "MINASMC3";
+    std::string path(const std::string& key) const { return dir + "/" + key + ".asmc"; }
+    std::string dir; // "": cache is off
+    long long cap, size = 0; // bytes
+    int entries = 0;
+    std::atomic<int> hits{ 0 }, misses{ 0 };
+};
+
+} // namespace
+
+struct AsmCache::Impl : BuildCache { using BuildCache::BuildCache; };
+
+AsmCache::AsmCache(std::string directory, long long capacity) : impl(std::make_unique<Impl>(std::move(directory), capacity)) {}
+AsmCache::~AsmCache() {}
+std::string AsmCache::DefaultDir()
+{
+  if (const char* d = getenv("ASM_CACHE")) return d;
+#ifdef _WIN32
+  if (const char* d = getenv("LOCALAPPDATA")) return std::string(d) + "\\minimal-asm";
+#else
+  if (const char* d = getenv("XDG_CACHE_HOME")) return std::string(d) + "/minimal-asm";
+  if (const char* d = getenv("HOME")) return std::string(d) + "/.cache/minimal-asm";
+#endif
+  return "";
+}
+
+void AsmCache::Evict() { impl->Evict(); }
+void AsmCache::PrintStats(std::ostream& out) { impl->PrintStats(out); }
+
+struct AsmContext::Impl
+{
+  Workspace ws;
+  Diagnostics diag{ "" };
+  std::string out;
+  Products products;
+  std::unique_ptr<SourceFile> file; // source of AssembleFile()
+  void reset(std::string_view src, const Options& opt)
+  {
+    out.clear(); products.includes.clear(); products.symbols.clear();
+    if (opt.stats) products.stats.Reset();
+    diag.Reset(src, opt.allerrors);
+  }
+};
+
+AsmContext::AsmContext() : impl(std::make_unique<Impl>()) {}
+AsmContext::~AsmContext() {}
+
+bool AsmContext::Assemble(std::string_view src, const Options& opt, std::string_view path)
+{
+  impl->reset(src, opt);
+  Assembler(impl->ws, src, impl->out, impl->diag, opt, path, &impl->products);
+  return impl->diag.Count() == 0;
+}
+
+bool AsmContext::AssembleFile(const std::string& path, const Options& opt, AsmCache* cache)
+{
+  Impl& m = *impl;
+  if (opt.stats) m.products.stats.Start();
+  m.file = std::make_unique<SourceFile>(path.c_str());
+  if (!m.file->IsOpen()) return false;
+  std::string_view src = m.file->Text();
+  m.reset(src, opt); m.out.reserve(src.size() + 4096); // HEX output is typically smaller than its source
+  if (opt.stats) { m.products.stats.Stop(Stats::READ); cache = nullptr; } // measures assembling, not the cache
+  std::string key = cache ? BuildCache::Key(src, opt, path) : "";
+  m.ws.symbols.Clear();
+  if (!cache || !cache->impl->Load(key, m.out, m.diag, m.products)) // a hit skips the assembler
+  {
+    Assembler(m.ws, src, m.out, m.diag, opt, path, &m.products);
+    if (cache && m.diag.Count() == 0) cache->impl->Store(key, m.out, m.diag, m.products);
+  }
+  return true;
+}
+
+bool AsmContext::Update(std::string_view src, const Options& opt, std::string_view path)
+{
+  Workspace& ws = impl->ws;
+  if (!ws.lexed.tokens.empty() && ws.textpath == path) Relex(ws.text, src, ws.lexed, ws.scratch);
+  else
+  {
+    ws.text.assign(src); ws.textpath.assign(path);
+    ws.lexed.tokens.clear(); ws.lexed.terms.clear(); Tokenize(ws.text, ws.lexed);
+  }
+  impl->reset(ws.text, opt);
+  ws.islexed = true;
+  Assembler(ws, ws.text, impl->out, impl->diag, opt, path, &impl->products);
+  return impl->diag.Count() == 0;
+}
+
+int AsmContext::Find(std::string_view label) const
+{
+  const SymbolTable& symbols = impl->ws.symbols;
+  int k = symbols.Find(label);
+  return k == -1 || symbols.IsPoisoned(k) ? -1 : symbols.Value(k);
+}
+
+std::string_view AsmContext::Output() const { return impl->out; }
+std::string_view AsmContext::Symbols() const { return impl->products.symbols; }
+const std::vector<std::string>& AsmContext::Includes() const { return impl->products.includes; }
+int AsmContext::ErrorCount() const { return impl->diag.Count(); }
+void AsmContext::VisitErrors(const std::function<void(const AsmMessage&)>& visit) { impl->diag.Visit(visit); }
+void AsmContext::PrintErrors(std::ostream& out, DiagFormat format, std::string_view filename, bool isbatch)
+  { impl->diag.Print(out, format, filename, isbatch); }
+const std::vector<std::string>& AsmContext::Notes() const { return impl->diag.Notes(); }
+void AsmContext::PrintNotes(std::ostream& out, std::string_view prefix) const { impl->diag.PrintNotes(out, prefix); }
+void AsmContext::PrintStats(std::ostream& out, bool isjson) const { impl->products.stats.Print(out, isjson); }
+
+int AssembleBatch(const std::vector<std::string>& names, const Options& options, DiagFormat format, const std::string& outdir,
+                  int threads, AsmCache& asmcache)
+{
+  Options opt = options;
+  BuildCache& cache = *asmcache.impl;
+  struct Job { std::unique_ptr<SourceFile> file; std::unique_ptr<Diagnostics> diag; std::string target, symtarget; bool iswritten = false; };
+  const char* EXT[] { ".hex", ".s19", ".bin", ".seg" };
+  opt.threads = 1; // the files run concurrently already
+  std::vector<Job> jobs(names.size());
+  std::vector<std::pair<size_t, int>> order; // largest files first, for a short tail
+  for (size_t i=0; i<names.size(); i++)
+  {
+    Job& job = jobs[i];
+    job.file = std::make_unique<SourceFile>(names[i].c_str());
+    size_t slash = names[i].find_last_of("/\\"), dot = names[i].find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = names[i].size();
+    std::string stem = names[i].substr(0, dot); // "dir/file.asm" => "dir/file" or "outdir/file"
+    if (!outdir.empty()) stem = outdir + "/" + stem.substr(slash == std::string::npos ? 0 : slash + 1);
+    job.target = stem + (opt.dosym ? ".sym" : EXT[opt.format]);
+    job.symtarget = stem + ".msym";
+    order.push_back({ job.file->IsOpen() ? job.file->Text().size() : 0, int(i) });
+  }
+  std::sort(order.begin(), order.end(), std::greater<>());
+
+  ThreadPool pool(threads);
+  for (auto [size, i] : order)
+    pool.Add([&, i = i]
+    {
+      Job& job = jobs[i];
+      if (!job.file->IsOpen()) return;
+      std::string out; out.reserve(job.file->Text().size() + 4096);
+      job.diag = std::make_unique<Diagnostics>(job.file->Text(), opt.allerrors);
+      std::string key = BuildCache::Key(job.file->Text(), opt, names[i]);
+      Products products;
+      if (!cache.Load(key, out, *job.diag, products))
+      {
+        Workspace ws;
+        Assembler(ws, job.file->Text(), out, *job.diag, opt, names[i], &products);
+        if (job.diag->Count() > 0) return;
+        cache.Store(key, out, *job.diag, products);
+      }
+      std::ofstream file(job.target, std::ios::binary);
+      job.iswritten = file.write(out.data(), out.size()).good();
+      if (opt.doexport)
+      {
+        std::ofstream symfile(job.symtarget, std::ios::binary);
+        if (!symfile.write(products.symbols.data(), products.symbols.size())) { job.iswritten = false; job.target = job.symtarget; }
+      }
+    });
+  auto start = std::chrono::steady_clock::now();
+  pool.Run();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  int failed = 0; // aggregated diagnostics in the order of the input
+  for (size_t i=0; i<jobs.size(); i++)
+  {
+    Job& job = jobs[i];
+    if (!job.file->IsOpen()) { std::cout << ("ERROR: Can't open \"" + names[i] + "\".\n"); failed++; continue; }
+    job.diag->PrintNotes(std::cerr, names[i] + ": ");
+    if (job.diag->Count() > 0) { job.diag->Print(std::cout, format, names[i], true); failed++; }
+    else if (!job.iswritten) { std::cout << ("ERROR: Can't write \"" + job.target + "\".\n"); failed++; }
+  }
+  std::cout.flush();
+  fprintf(stderr, "%d files assembled, %d failed, %.3fs on %d threads.\n", int(jobs.size()) - failed, failed, secs, threads);
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+// Library interface of the next 'Minimal 64x4 Redux Smart Assembler'
+// by Carsten Herting (slu4) 2025, last update 17.10.2026
+
+// Build the library with: g++ -c minasm.cpp -std=c++17 -O2 -pthread && ar rcs libminasm.a minasm.o
+
+// An AsmContext keeps the memory of its tokens, symbols, output and messages from one assembly to the next. After
+// warm-up, assembling sources of similar size allocates nothing (unless errors, warnings or '#include' occur).
+//
+//   AsmContext ctx; Options opt;
+//   if (ctx.Assemble("#org 0x8000 LDI 0x41 OUT", opt)) use(ctx.Output());
+//   else ctx.VisitErrors([](const AsmMessage& m) { report(m.line, m.text); });
+
+#ifndef MINASM_H
+#define MINASM_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <iosfwd>
+
+enum OutFormat { OUT_HEX, OUT_SREC, OUT_BIN, OUT_SEG };
+
+struct Options // assembler settings taken from the command line
+{
+  bool dosym = false; // output symbolic constants instead of machine code
+  std::string_view symtag; // ... starting with this tag
+  OutFormat format = OUT_HEX; // output format of the machine code
+  int binbase = -1; // first address of a raw binary image, -1: lowest emitted address
+  uint8_t fill = 0xff; // value of the gaps in a raw binary image and of padding bytes
+  int reclen = 16; // maximum number of data bytes per record (MinOS 'receive' accepts up to 19)
+  int mergegap = -1; // -1: records in order of emission, >= 0: address-ordered, gaps up to this size padded
+  bool report = false; // report the predicted upload time
+  bool pack = false; // output a compressed image with an unpacker instead
+  int packaddr = -1; // address of the unpacker, -1: highest free RAM
+  int threads = 1; // threads of pass 2 for large sources
+  bool doexport = false; // produce a binary symbol file, too
+  bool allerrors = false; // report all errors instead of stopping at the first one
+  bool stats = false; // time the phases and count what the source contains (no build cache)
+  bool strip = false; // leaves out the blocks of code and data that nothing reaches, reports the size of each block
+  bool listing = false; // notes list the lines of every macro and '#rep' expansion
+  bool loopweight = false; // '#var': references inside loops count 8 times per nesting level
+  bool optimize = false; // rewrite instructions into equivalent ones of fewer cycles (peephole optimizer)
+  bool relax = false; // turn jumps into fast page-local jumps wherever their target lies in the same page
+};
+
+enum DiagFormat { DIAG_TEXT, DIAG_GNU, DIAG_JSON }; // "ERROR in line ..", "file:line:col: error: ..", JSON lines
+
+struct AsmMessage // an error and where it is
+{
+  std::string_view file; // included file, "": the assembled source itself
+  int line, column; // 1-based
+  std::string_view text, detail; // detail: appended to the line number in DIAG_TEXT
+};
+
+class AsmCache // persistent store of successful outputs, shared by all contexts and threads
+{
+  public:
+    AsmCache(std::string directory, long long capacity); // directory "": the cache is off, capacity in bytes
+    ~AsmCache();
+    static std::string DefaultDir(); // $ASM_CACHE or the user's cache directory, "": none
+    void Evict(); // removes the least recently used outputs until the cache fits its capacity
+    void PrintStats(std::ostream& out); // hits, misses and size, call after Evict()
+  protected:
+    friend class AsmContext;
+    friend int AssembleBatch(const std::vector<std::string>&, const Options&, DiagFormat, const std::string&, int, AsmCache&);
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+class AsmContext // reusable assembler, the results of an assembly are valid until the next one
+{
+  public:
+    AsmContext();
+    ~AsmContext();
+    bool Assemble(std::string_view src, const Options& opt, std::string_view path = ""); // true: no errors
+    bool AssembleFile(const std::string& path, const Options& opt, AsmCache* cache = nullptr); // false: can't open it
+    // Assembles a new version of the source of the last Update() (with the same path), which is kept in the context:
+    // only the changed lines are lexed again. Meant for editors and 'asm --watch'.
+    bool Update(std::string_view src, const Options& opt, std::string_view path = ""); // true: no errors
+    int Find(std::string_view label) const; // address of a label of the last assembly, -1: unknown (or a cache hit)
+    std::string_view Output() const; // machine code in the chosen format (or the symbol list)
+    std::string_view Symbols() const; // binary symbol file (Options::doexport)
+    const std::vector<std::string>& Includes() const; // canonical paths of the included and imported files
+    int ErrorCount() const;
+    void VisitErrors(const std::function<void(const AsmMessage&)>& visit); // sorted by position
+    void PrintErrors(std::ostream& out, DiagFormat format, std::string_view filename, bool isbatch = false);
+    const std::vector<std::string>& Notes() const; // warnings and reports
+    void PrintNotes(std::ostream& out, std::string_view prefix = "") const;
+    void PrintStats(std::ostream& out, bool isjson = false) const; // of the last assembly with Options::stats
+  protected:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Assembles each file to <file>.hex (.s19 .bin .seg .sym) [in outdir] on 'threads' threads and prints the errors and
+// notes of all files in their order. Returns 0 if all files were assembled, 1 otherwise.
+int AssembleBatch(const std::vector<std::string>& names, const Options& opt, DiagFormat format, const std::string& outdir,
+                  int threads, AsmCache& cache);
+
+#endif